@@ -1,2 +1,2 @@
 #!/bin/bash
-gcc -o tree_view.so tree_view.c $(yed --print-cflags) $(yed --print-ldflags)
+gcc -o tree_view.so tree_view.c $(yed --print-cflags) $(yed --print-ldflags) -lpthread
@@ -1,15 +1,48 @@
 #include <yed/plugin.h>
 #include <time.h>
-
-#define IS_ROOT   -1
-#define IS_FILE    0
-#define IS_DIR     1
-#define IS_IMAGE   2
-#define IS_ARCHIVE 3
-#define IS_LINK    4
-#define IS_B_LINK  5
-#define IS_DEVICE  6
-#define IS_EXEC    7
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <poll.h>
+#include <dlfcn.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define TREE_VIEW_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+#include "tree_view.h"
+
+#define IS_ROOT    TREE_VIEW_ROOT
+#define IS_FILE    TREE_VIEW_FILE
+#define IS_DIR     TREE_VIEW_DIR
+#define IS_IMAGE   TREE_VIEW_IMAGE
+#define IS_ARCHIVE TREE_VIEW_ARCHIVE
+#define IS_LINK    TREE_VIEW_LINK
+#define IS_B_LINK  TREE_VIEW_B_LINK
+#define IS_DEVICE  TREE_VIEW_DEVICE
+#define IS_EXEC    TREE_VIEW_EXEC
+#define IS_SUMMARY TREE_VIEW_SUMMARY
+#define PREVIEW_LINE_MAX 512
+#define TASK_REFRESH     0
+#define TASK_EXPAND      1
+#define TASK_RECLASSIFY  2
+#define TASK_GREP        3
+#define RECLASSIFY_SLICE 256
+#define EXPORT_JSON      0
+#define EXPORT_NDJSON    1
+#define EXPORT_BINARY    2
+#define EXPORT_BUFF_SIZE (1 << 20)
 #define MAYBE_CONVERT(rgb) (tc ? (rgb) : rgb_to_256(rgb))
 
 /* global structs */
@@ -21,8 +54,203 @@ typedef struct {
     int          num_tabs;
     int          open_children;
     int          color_loc;
+    mode_t       mode;
+    off_t        size;
+    time_t       mtime;
+    dev_t        dev;
+    ino_t        ino;
+    dev_t        top_dev;
 } file;
 
+typedef struct {
+    char        name[256];
+    struct stat st;
+    int         broken;
+} dir_entry;
+
+typedef struct {
+    int entries;
+    int dirs;
+} dir_count;
+
+/* What a scan learned about one inode.  Shared by every scan on the editor
+ * thread, so a hard link, or a directory reached again through a symlink
+ * or another root, is not stat'ed twice until the next refresh. */
+typedef struct {
+    dev_t          dev;
+    ino_t          ino;
+    unsigned       epoch;
+    unsigned long  name_hash;
+    struct stat    st;
+    int            broken;
+    char          *link;          /* links: what they point to */
+    mode_t         target_mode;   /* links: stat() of the target */
+    dev_t          target_dev;
+    ino_t          target_ino;
+    time_t         target_mtime;
+} meta;
+
+/* The directory a row shows: its own inode, or a link's target. */
+typedef struct {
+    dev_t           dev;
+    ino_t           ino;
+    struct timespec mtim;
+} dir_id;
+
+/* One directory's scan result, shared by every row that shows it. */
+typedef struct {
+    dev_t            dev;
+    ino_t            ino;
+    struct timespec  mtim;  /* of the directory when it was read */
+    array_t          entries;
+    dir_count        count;
+} listing;
+
+#ifdef TREE_VIEW_URING
+typedef struct {
+    int                  fd;
+    unsigned             depth;
+    void                *sq_ptr;
+    void                *cq_ptr;
+    size_t               sq_sz;
+    size_t               cq_sz;
+    struct io_uring_sqe *sqes;
+    size_t               sqes_sz;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring;
+#endif
+
+typedef struct {
+    char            path[1024];
+    int             stat_only;  /* just lstat() path into st */
+    int             follow;     /* stat() instead of lstat() */
+    struct stat     st;
+    int             err;
+    array_t         hidden;
+    int             limit;
+    int             uring_depth;
+    array_t         entries;
+    dir_count       count;
+    int             status;
+    int             done;
+    int             abandoned;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} scan_job;
+
+typedef struct {
+    char               *path;
+    time_t              mtime;
+    off_t               size;
+    int                 n_lines;
+    array_t             lines;
+    unsigned long long  used;
+} preview_entry;
+
+/* Work that may not fit in one pump.  Each step is small and the state
+ * here is enough to resume on the next pump. */
+typedef struct {
+    int      kind;
+    array_t  paths;     /* refresh: open directories left, last row first */
+    char     root[512]; /* expand: directory being expanded */
+    char     last[512]; /* expand: last directory loaded */
+    int      pos;       /* reclassify: next row; grep: next result */
+    int      entries;   /* entries handled so far */
+    int      pumps;     /* pumps the task has run in */
+} task;
+
+typedef struct {
+    dev_t  dev;
+    int    unresponsive;
+    int    backoff;
+    time_t retry_at;
+} mount_state;
+
+typedef struct {
+    char  path[1024];   /* absolute */
+    dev_t dev;
+} mount_point;
+
+typedef struct {
+    char      *path;
+    int        kind;
+    int        depth;
+    unsigned   mode;
+    long long  size;
+    long long  mtime;
+} export_node;
+
+typedef struct {
+    char       out_path[1024];
+    char       walk[1024];  /* directory to walk; empty exports nodes */
+    int        format;
+    array_t    nodes;       /* export_node, copied from the tree */
+    array_t    hidden;
+    array_t    archive_extensions;
+    array_t    image_extensions;
+    int        one_filesystem;
+    dev_t      walk_dev;
+    int        walk_depth;  /* depth of walk's entries, as rows would have */
+    int        fd;
+    char      *buff;
+    int        buff_len;
+    long long  count;
+    int        error;
+    int        done;
+    int        cancel;
+    pthread_t  thread;
+} export_job;
+
+typedef struct {
+    tree_view_change_fn  fn;
+    void                *arg;
+} subscriber;
+
+typedef struct {
+    char *path;
+    int   count;
+} grep_result;
+
+typedef struct {
+    pthread_mutex_t lock;
+    array_t         dirs;
+} grep_deque;
+
+struct grep_job;
+
+typedef struct {
+    struct grep_job *job;
+    int              worker;
+} grep_worker_arg;
+
+typedef struct grep_job {
+    regex_t          re;
+    int              pure;
+    char             literal[256];
+    int              literal_len;
+    array_t          hidden;
+    int              n_workers;
+    int              n_threads;
+    pthread_t       *threads;
+    grep_deque      *deques;
+    grep_worker_arg *args;
+    int              outstanding;
+    int              queued;
+    int              finished;
+    int              cancel;
+    pthread_mutex_t  idle_lock;
+    pthread_cond_t   idle;
+    pthread_mutex_t  results_lock;
+    array_t          results;
+} grep_job;
+
 /* global vars */
 static yed_plugin *Self;
 static array_t     hidden_items;
@@ -31,6 +259,47 @@ static array_t     archive_extensions;
 static array_t     files;
 static time_t      last_time;
 static time_t      wait_time;
+static array_t     subscribers;
+static int        *path_index;
+static int         path_index_cap;
+static unsigned long long generation;
+static unsigned long long index_generation;
+static unsigned long long notified_generation;
+static grep_job   *grep;
+static grep_result *grep_counts;
+static int         grep_counts_cap;
+static int         grep_counts_len;
+static int         grep_n_files;
+static array_t     grep_pending;    /* grep_result, waiting for TASK_GREP */
+static array_t     mounts;
+static array_t     mount_points;
+static int         mountinfo_fd = -1;
+static array_t     forced_dirs;
+static array_t     roots;
+static listing   **listings;
+static int         listings_cap;
+static int         listings_len;
+static meta      **metas;
+static int         metas_cap;
+static int         metas_len;
+static unsigned    meta_epoch = 1;
+static pthread_t   main_thread;
+#ifdef TREE_VIEW_URING
+static uring       main_ring;
+static int         main_ring_depth;
+static int         uring_unavailable; /* io_uring_setup() failed; use lstat() */
+#endif
+static array_t     preview_cache;
+static unsigned long long preview_clock;
+static unsigned long long preview_pending_since;
+static int         preview_pending_row = -1;
+static int         preview_row = -1;
+static unsigned long long preview_generation;
+static int         setting_roots;
+static array_t     tasks;
+static const char *task_phases[] = { "refresh", "expand", "reclassify", "grep" };
+static time_t      refresh_period;
+static export_job *exporting;
 
 /* internal functions*/
 static void        _tree_view(int n_args, char **args);
@@ -41,15 +310,120 @@ static void        _tree_view_select(void);
 static void        _tree_view_line_handler(yed_event *event);
 static void        _tree_view_key_pressed_handler(yed_event *event);
 static void        _tree_view_update_handler(yed_event *event);
+static void        _tree_view_var_handler(yed_event *event);
+static void        _tree_view_grep(int n_args, char **args);
+static void        _tree_view_grep_cancel(int n_args, char **args);
+static void        _tree_view_preview(int n_args, char **args);
+static void        _tree_view_add_root(int n_args, char **args);
+static void        _tree_view_remove_root(int n_args, char **args);
+static void        _tree_view_stat_bench(int n_args, char **args);
+static void        _tree_view_expand_recursive(int n_args, char **args);
+static void        _tree_view_export(int n_args, char **args);
+static void        _tree_view_export_cancel(int n_args, char **args);
+static void        _tree_view_refresh(void);
+static void        _tree_view_rebuild(void);
 static void        _tree_view_unload(yed_plugin *self);
 
+/* query api */
+static unsigned long long _api_generation(void);
+static int         _api_lookup(const char *path, tree_view_node *out);
+static int         _api_children(const char *path, tree_view_visit_fn fn, void *arg);
+static int         _api_prefix(const char *prefix, tree_view_visit_fn fn, void *arg);
+static int         _api_glob(const char *pattern, tree_view_visit_fn fn, void *arg);
+static int         _api_subscribe(tree_view_change_fn fn, void *arg);
+static void        _api_unsubscribe(int handle);
+
 /* internal helper functions */
 static yed_buffer *_get_or_make_buff(void);
+static void        _add_roots(void);
 static void        _add_hidden_items(void);
 static void        _add_archive_extensions(void);
 static void        _add_image_extensions(void);
 static void        _clear_files(void);
 static int         _cmpfunc(const void *a, const void *b);
+static int         _tree_view_row_text(file *f, int last, char *out);
+static int         _tree_view_is_last(int idx);
+static void        _tree_view_redraw_row(int idx);
+static void        _tree_view_redraw_rows(void);
+static int         _subtree_end(int idx);
+static void        _tree_view_insert_row(int idx, file *f);
+static void        _tree_view_delete_rows(int start, int end);
+static int         _tree_view_reconcile_dir(int idx);
+static int         _tree_view_reclassify(int start, int end);
+static const char *_child_char(const char *var, const char *dflt);
+static void        _tree_view_changed(void);
+static void        _notify_subscribers(void);
+static int         _find_file(const char *path);
+static void        _normalize_path(const char *in, char *out);
+static void        _fill_node(file *f, tree_view_node *out);
+static int         _grep_count(const char *path);
+static void        _grep_count_add(const char *path, int count);
+static void        _grep_counts_clear(void);
+static void        _grep_stop(void);
+static void        _grep_drain(void);
+static void        _grep_pending_clear(void);
+static void        _grep_reveal(const char *path, int count);
+static int         _scan_dir(const char *dir_path, array_t hidden, int limit,
+                             int uring_depth, array_t *out, dir_count *count);
+static void        _stat_entries(DIR *dr, const char *dir_path, array_t entries, int uring_depth);
+static int         _uring_depth(void);
+static int         _scan_dir_with_timeout(file *f, dev_t dev, int limit,
+                                          array_t *out, dir_count *count);
+static void        _pin_library(void);
+static scan_job   *_scan_job_new(const char *path);
+static int         _scan_job_run(scan_job *job, mount_state *m);
+static void        _stat_mount_point(const char *dir_path, dir_entry *e, dev_t dev);
+static void        _mount_points_load(void);
+static int         _mount_point_dev(const char *abs_dir, const char *name, dev_t *dev);
+static int         _dir_limit(file *f, int own_rows);
+static void        _tree_view_add_summary(int idx, dir_count *count);
+static void        _tree_view_load_anyway(int idx);
+static int         _is_hidden(array_t hidden, const char *name);
+static int         _matches_patterns(const char *patterns, const char *name);
+static int         _is_forced(const char *path);
+static void        _set_forced(const char *path, int forced);
+static mount_state *_mount_state(dev_t dev);
+static int         _dev_unresponsive(dev_t dev);
+static int         _is_yes(const char *val);
+static int         _classify(const char *name, mode_t mode, int broken);
+static int         _classify_with(const char *name, mode_t mode, int broken,
+                                  array_t archive, array_t image);
+static void        _export_drain(void);
+static void        _export_stop(void);
+static int         _export_walk_depth(const char *path);
+static listing    *_listing_find(dev_t dev, ino_t ino);
+static listing    *_listing_store(dir_id *id, array_t entries);
+static listing    *_listing_current(file *f, dir_id *id);
+static void        _listings_clear(void);
+static meta       *_meta_find(dev_t dev, ino_t ino);
+static void        _meta_store(const char *dir_path, dir_entry *e, struct stat *target);
+static void        _stat_entry(const char *dir_path, dir_entry *e, struct stat *target);
+static void        _clean_abs_path(char *path);
+static dev_t       _link_target_dev(const char *path);
+static int         _stat_link_target(const char *path, dev_t link_dev, struct stat *out);
+static void        _metas_invalidate(void);
+static void        _metas_clear(void);
+static int         _dir_id_of(file *f, dir_id *out);
+static unsigned long _hash_path(const char *path);
+static void        _set_roots_var(void);
+static int         _path_within(const char *path, const char *root);
+static int         _root_is_nested(const char *path);
+static int         _tree_view_open_path(const char *path);
+static unsigned long long _now_ms(void);
+static unsigned long long _now_us(void);
+static int         _budget_ms(void);
+static void        _budget_check(const char *phase, unsigned long long start_us,
+                                 int entries, const char *unit);
+static task       *_task_find(int kind);
+static task       *_task_queue(int kind);
+static void        _task_cancel(int kind);
+static void        _task_free(task *t);
+static int         _task_step(task *t);
+static int         _count_children(int idx);
+static void        _task_done(task *t);
+static void        _tasks_run(unsigned long long start_us);
+static void        _preview_update(void);
+static void        _preview_clear_cache(void);
 static file       *_init_file(int parent_idx, char *path, char *name,
                               int if_dir, int num_tabs, int color_loc);
 
@@ -57,15 +431,22 @@ int yed_plugin_boot(yed_plugin *self) {
     yed_event_handler tree_view_key;
     yed_event_handler tree_view_line;
     yed_event_handler tree_view_update;
+    yed_event_handler tree_view_var;
+    int               i;
 
     YED_PLUG_VERSION_CHECK();
 
-    Self = self;
+    Self        = self;
+    main_thread = pthread_self();
 
     if (yed_get_var("tree-view-update-period") == NULL) {
         yed_set_var("tree-view-update-period", "5");
     }
 
+    if (yed_get_var("tree-view-roots") == NULL) {
+        yed_set_var("tree-view-roots", "");
+    }
+
     if (yed_get_var("tree-view-hidden-items") == NULL) {
         yed_set_var("tree-view-hidden-items", "");
     }
@@ -118,14 +499,102 @@ int yed_plugin_boot(yed_plugin *self) {
         yed_set_var("tree-view-broken-link-color", "&black swap &red.fg");
     }
 
+    if (yed_get_var("tree-view-grep-match-color") == NULL) {
+        yed_set_var("tree-view-grep-match-color", "&yellow bold");
+    }
+
+    if (yed_get_var("tree-view-grep-threads") == NULL) {
+        yed_set_var("tree-view-grep-threads", "0");
+    }
+
+    if (yed_get_var("tree-view-one-filesystem") == NULL) {
+        yed_set_var("tree-view-one-filesystem", "no");
+    }
+
+    if (yed_get_var("tree-view-mount-timeout-ms") == NULL) {
+        yed_set_var("tree-view-mount-timeout-ms", "2000");
+    }
+
+    if (yed_get_var("tree-view-max-dir-entries") == NULL) {
+        yed_set_var("tree-view-max-dir-entries", "2000");
+    }
+
+    if (yed_get_var("tree-view-max-nodes") == NULL) {
+        yed_set_var("tree-view-max-nodes", "20000");
+    }
+
+    if (yed_get_var("tree-view-lazy-patterns") == NULL) {
+        yed_set_var("tree-view-lazy-patterns", "");
+    }
+
+    if (yed_get_var("tree-view-preview") == NULL) {
+        yed_set_var("tree-view-preview", "no");
+    }
+
+    if (yed_get_var("tree-view-preview-lines") == NULL) {
+        yed_set_var("tree-view-preview-lines", "40");
+    }
+
+    if (yed_get_var("tree-view-preview-debounce-ms") == NULL) {
+        yed_set_var("tree-view-preview-debounce-ms", "100");
+    }
+
+    if (yed_get_var("tree-view-preview-cache-size") == NULL) {
+        yed_set_var("tree-view-preview-cache-size", "8");
+    }
+
+    if (yed_get_var("tree-view-stat-backend") == NULL) {
+        yed_set_var("tree-view-stat-backend", "sync");
+    }
+
+    if (yed_get_var("tree-view-uring-depth") == NULL) {
+        yed_set_var("tree-view-uring-depth", "64");
+    }
+
+    if (yed_get_var("tree-view-max-handler-ms") == NULL) {
+        yed_set_var("tree-view-max-handler-ms", "10");
+    }
+
+    if (yed_get_var("tree-view-unresponsive-color") == NULL) {
+        yed_set_var("tree-view-unresponsive-color", "&black swap &magenta.fg");
+    }
+
     yed_plugin_set_command(self, "tree-view", _tree_view);
+    yed_plugin_set_command(self, "tree-view-grep", _tree_view_grep);
+    yed_plugin_set_command(self, "tree-view-grep-cancel", _tree_view_grep_cancel);
+    yed_plugin_set_command(self, "tree-view-preview", _tree_view_preview);
+    yed_plugin_set_command(self, "tree-view-add-root", _tree_view_add_root);
+    yed_plugin_set_command(self, "tree-view-remove-root", _tree_view_remove_root);
+    yed_plugin_set_command(self, "tree-view-stat-bench", _tree_view_stat_bench);
+    yed_plugin_set_command(self, "tree-view-expand-recursive", _tree_view_expand_recursive);
+    yed_plugin_set_command(self, "tree-view-export", _tree_view_export);
+    yed_plugin_set_command(self, "tree-view-export-cancel", _tree_view_export_cancel);
 
     yed_plugin_set_unload_fn(self, _tree_view_unload);
 
+    subscribers = array_make(subscriber);
+    mounts      = array_make(mount_state);
+    mount_points  = array_make(mount_point);
+    forced_dirs   = array_make(char *);
+    preview_cache = array_make(preview_entry *);
+    roots         = array_make(char *);
+    tasks         = array_make(task *);
+    grep_pending  = array_make(grep_result);
+
+    _add_roots();
+
     _tree_view_init();
 
-    wait_time = atoi(yed_get_var("tree-view-update-period"));
-    last_time = time(NULL);
+    /* roots start out expanded */
+    for (i = array_len(files) - 1; i > 0 && array_len(roots) > 0; i--) {
+        if ((*(file **)array_item(files, i))->num_tabs == 0) {
+            _tree_view_add_dir(i);
+        }
+    }
+
+    wait_time      = atoi(yed_get_var("tree-view-update-period"));
+    refresh_period = wait_time;
+    last_time      = time(NULL);
 
     tree_view_key.kind = EVENT_KEY_PRESSED;
     tree_view_key.fn   = _tree_view_key_pressed_handler;
@@ -139,6 +608,13 @@ int yed_plugin_boot(yed_plugin *self) {
     tree_view_update.fn   = _tree_view_update_handler;
     yed_plugin_add_event_handler(self, tree_view_update);
 
+    tree_view_var.kind = EVENT_VAR_POST_SET;
+    tree_view_var.fn   = _tree_view_var_handler;
+    yed_plugin_add_event_handler(self, tree_view_var);
+
+    tree_view_var.kind = EVENT_VAR_POST_UNSET;
+    yed_plugin_add_event_handler(self, tree_view_var);
+
 
     return 0;
 }
@@ -159,7 +635,13 @@ static void _tree_view(int n_args, char **args) {
 
 static void _tree_view_init(void) {
     file       *dot;
+    file       *root;
     yed_buffer *buff;
+    char      **c_it;
+    char       *name;
+    char        write_name[1024];
+    struct stat statbuf;
+    int         row;
 
     if (array_len(files) == 0) {
         files = array_make(file *);
@@ -176,152 +658,172 @@ static void _tree_view_init(void) {
     yed_buff_clear_no_undo(buff);
     buff->flags |= BUFF_RD_ONLY;
 
-    dot = _init_file(IS_ROOT, ".", ",", IS_DIR, -1, 1);
+    /* without extra roots the tree is "." itself; otherwise an unnamed
+     * anchor holds one collapsible row per root */
+    if (array_len(roots) == 0) {
+        dot = _init_file(IS_ROOT, ".", ",", IS_DIR, -1, 1);
+        if (stat(".", &statbuf) == 0) {
+            dot->dev   = statbuf.st_dev;
+            dot->ino   = statbuf.st_ino;
+            dot->mtime = statbuf.st_mtime;
+        }
+        dot->top_dev = dot->dev;
+        array_push(files, dot);
+        _tree_view_changed();
+
+        _tree_view_add_dir(0);
+        return;
+    }
+
+    dot = _init_file(IS_ROOT, "", ",", IS_ROOT, -1, 1);
+    dot->open_children = 1;
     array_push(files, dot);
 
-    _tree_view_add_dir(0);
+    buff->flags &= ~BUFF_RD_ONLY;
+
+    row = 1;
+    array_traverse(roots, c_it) {
+        /* show "src" rather than the normalized "./src" */
+        name = *c_it;
+        if (strncmp(name, "./", 2) == 0) { name += 2; }
+
+        root = _init_file(0, *c_it, name, IS_DIR, 0, 0);
+        if (stat(*c_it, &statbuf) == 0) {
+            root->mode  = statbuf.st_mode;
+            root->size  = statbuf.st_size;
+            root->mtime = statbuf.st_mtime;
+            root->dev   = statbuf.st_dev;
+            root->ino   = statbuf.st_ino;
+        }
+        root->top_dev = root->dev;
+        array_push(files, root);
+
+        if (row > 1) {
+            yed_buff_insert_line_no_undo(buff, row);
+        }
+        root->color_loc = _tree_view_row_text(root, 1, write_name);
+        yed_buff_insert_string_no_undo(buff, write_name, row, 1);
+
+        row++;
+    }
+
+    buff->flags |= BUFF_RD_ONLY;
+
+    _tree_view_changed();
 }
 
 static void _tree_view_add_dir(int idx) {
-    char          **str_it;
     file          **f_it;
     file           *f;
     file           *new_f;
     yed_buffer     *buff;
-    struct dirent  *de;
-    DIR            *dr;
-    FILE           *fs;
+    dir_entry      *e_it;
+    array_t         entries;
+    array_t         tmp_files;
     int             new_idx;
     int             dir;
     int             tabs;
-    int             i;
-    int             j;
     int             color_loc;
-    char            path[1024];
-    char            name[512];
-    char            write_name[512];
-    struct stat     statbuf;
-    array_t         tmp_files;
     int             loc;
+    int             limit;
+    int             status;
+    char            path[1024];
+    char            write_name[1024];
+    dir_count       count;
+    listing        *cached;
+    file           *anc;
+    dir_id          id;
+    dir_id          anc_id;
+
+    buff  = _get_or_make_buff();
+    f     = *(file **)array_item(files, idx);
+
+    if (_dir_id_of(f, &id) != 0) { return; }
+
+    /* a symlink can lead back into a directory it sits in */
+    if (f->flags == IS_LINK) {
+        for (anc = (file *)f->parent; anc; anc = (file *)anc->parent) {
+            if (_dir_id_of(anc, &anc_id) == 0
+            &&  anc_id.ino == id.ino && anc_id.dev == id.dev) {
+                yed_cprint("tree-view: '%s' leads back to '%s'", f->path, anc->path);
+                return;
+            }
+        }
+    }
 
-    tmp_files = array_make(file *);
+    limit = _dir_limit(f, 0);
 
-    buff = _get_or_make_buff();
-    f    = *(file **)array_item(files, idx);
-    dr   = opendir(f->path);
+    cached = _listing_current(f, &id);
+    if (cached) {
+        /* already scanned through another root or path */
+        if (limit >= 0 && cached->count.entries > limit) {
+            _tree_view_add_summary(idx, &cached->count);
+            return;
+        }
+        entries = cached->entries;
+    } else {
+        if (id.dev != f->top_dev) {
+            if (_is_yes(yed_get_var("tree-view-one-filesystem"))) {
+                yed_cprint("tree-view: '%s' is on another filesystem", f->path);
+                return;
+            }
 
-    if (dr == NULL) { return; }
+            status = _scan_dir_with_timeout(f, id.dev, limit, &entries, &count);
+        } else {
+            status = _scan_dir(f->path, hidden_items, limit, _uring_depth(), &entries, &count);
+        }
 
-    buff->flags &= ~BUFF_RD_ONLY;
+        if (status < 0) { return; }
 
-    new_idx = idx+1;
-    while ((de = readdir(dr)) != NULL) {
-        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
-            continue;
+        if (status > 0) {
+            _tree_view_add_summary(idx, &count);
+            return;
         }
 
-        array_traverse(hidden_items, str_it) {
-            if (strstr(de->d_name, (*str_it))) {
-                goto cont;
-            }
-        }
+        cached = _listing_store(&id, entries);
+    }
+
+    tmp_files = array_make(file *);
+
+    buff->flags &= ~BUFF_RD_ONLY;
 
+    tabs = f->num_tabs+1;
+
+    new_idx = idx+1;
+    array_traverse(entries, e_it) {
         if (new_idx > 1) {
             yed_buff_insert_line_no_undo(buff, new_idx);
         }
 
         f->open_children = 1;
 
-        memset(path, 0, sizeof(char[512]));
-        sprintf(path, "%s/%s", f->path, de->d_name);
-
-        tabs = f->num_tabs+1;
-        memset(name, 0, sizeof(char[512]));
-        strcat(name, de->d_name);
-
-        dir = 0;
-        if (lstat(path, &statbuf) == 0) {
-            switch (statbuf.st_mode & S_IFMT) {
-                case S_IFDIR:
-                    dir = IS_DIR;
-                    break;
-                case S_IFLNK:
-                    fs = fopen(path, "r");
-                    if (!fs && errno == 2) {
-                        dir = IS_B_LINK;
-                    } else {
-                        dir = IS_LINK;
-                    }
-                    break;
-                case S_IFBLK:
-                case S_IFCHR:
-                    dir = IS_DEVICE;
-                    break;
-                default:
-                    if (statbuf.st_mode & S_IXUSR) {
-                        dir = IS_EXEC;
-                    } else {
-                        array_traverse(archive_extensions, str_it) {
-                            if (strstr(de->d_name, (*str_it))) {
-                                dir = IS_ARCHIVE;
-                                goto break_switch;
-                            }
-                        }
-
-                        array_traverse(image_extensions, str_it) {
-                            if (strstr(de->d_name, (*str_it))) {
-                                dir = IS_IMAGE;
-                                goto break_switch;
-                            }
-                        }
-
-                        dir = IS_FILE;
-                    }
-                    break;
-            }
-        }
-break_switch:;
+        snprintf(path, sizeof(path), "%s/%s", f->path, e_it->name);
+
+        dir       = _classify(e_it->name, e_it->st.st_mode, e_it->broken);
         color_loc = 0;
-        new_f = _init_file(idx, path, name, dir, tabs, color_loc);
+        new_f     = _init_file(idx, path, e_it->name, dir, tabs, color_loc);
+        new_f->mode  = e_it->st.st_mode;
+        new_f->size  = e_it->st.st_size;
+        new_f->mtime = e_it->st.st_mtime;
+        new_f->dev   = e_it->st.st_dev;
+        new_f->ino   = e_it->st.st_ino;
 
         array_push(tmp_files, new_f);
 
         new_idx++;
-
-cont:;
     }
 
-    closedir(dr);
+    if (cached == NULL) {
+        array_free(entries);
+    }
 
     qsort(array_data(tmp_files), array_len(tmp_files), sizeof(file *), _cmpfunc);
 
     new_idx = idx+1;
     loc = 0;
     array_traverse(tmp_files, f_it) {
-        color_loc = (*f_it)->num_tabs * yed_get_tab_width();
-        memset(write_name, 0, sizeof(char[512]));
-
-        if ((*f_it)->num_tabs > 0) {
-            color_loc += 1;
-
-            for  (i = 0; i < (*f_it)->num_tabs; i++) {
-                strcat(write_name, yed_get_var("tree-view-child-char-i"));
-                for (j = 0; j < yed_get_tab_width()-1; j++) {
-                    strcat(write_name, " ");
-                }
-            }
-
-            if (loc == array_len(tmp_files)-1) {
-                strcat(write_name, yed_get_var("tree-view-child-char-l"));
-            } else {
-                strcat(write_name, yed_get_var("tree-view-child-char-t"));
-            }
-
-            strcat(write_name, (*f_it)->name);
-            yed_buff_insert_string_no_undo(buff, write_name, new_idx, 1);
-        } else {
-            yed_buff_insert_string_no_undo(buff, (*f_it)->name, new_idx, 1);
-        }
+        color_loc = _tree_view_row_text(*f_it, loc == array_len(tmp_files)-1, write_name);
+        yed_buff_insert_string_no_undo(buff, write_name, new_idx, 1);
 
         (*f_it)->color_loc = color_loc;
 
@@ -337,368 +839,4496 @@ cont:;
 
     buff->flags |= BUFF_RD_ONLY;
     array_free(tmp_files);
+
+    _tree_view_changed();
 }
 
-static void _tree_view_remove_dir(int idx) {
-    yed_buffer *buff;
-    file       *f;
-    file       *remove;
-    int         next_idx;
+/*
+ * Reads a directory without touching any editor state, so that it can run
+ * on a worker thread.  Unless limit is negative, the entries are counted
+ * first from d_type alone; if there are more than limit of them nothing is
+ * stat'ed, count is filled in and 1 is returned.
+ */
+static int _scan_dir(const char *dir_path, array_t hidden, int limit,
+                     int uring_depth, array_t *out, dir_count *count) {
+    struct dirent  *de;
+    DIR            *dr;
+    dir_entry       e;
 
-    next_idx = idx + 1;
+    if ((dr = opendir(dir_path)) == NULL) { return -1; }
 
-    buff = _get_or_make_buff();
-    buff->flags &= ~BUFF_RD_ONLY;
+    memset(count, 0, sizeof(dir_count));
 
-    f = *(file **)array_item(files, idx);
+    if (limit >= 0) {
+        while ((de = readdir(dr)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
 
-    remove = *(file **)array_item(files, next_idx);
-    while (array_len(files) > next_idx && remove && remove->num_tabs > f->num_tabs) {
-        free(remove);
-        array_delete(files, next_idx);
-        yed_buff_delete_line(buff, next_idx);
+            if (_is_hidden(hidden, de->d_name)) { continue; }
 
-        if (array_len(files) <= next_idx) {
-            break;
+            count->entries += 1;
+            if (de->d_type == DT_DIR) {
+                count->dirs += 1;
+            }
         }
-        remove = *(file **)array_item(files, next_idx);
+
+        if (count->entries > limit) {
+            closedir(dr);
+            return 1;
+        }
+
+        rewinddir(dr);
     }
 
-    f->open_children = 0;
+    *out = array_make(dir_entry);
 
-    buff->flags |= BUFF_RD_ONLY;
+    while ((de = readdir(dr)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (_is_hidden(hidden, de->d_name)) { continue; }
+
+        memset(&e, 0, sizeof(e));
+        strncat(e.name, de->d_name, sizeof(e.name) - 1);
+        e.st.st_ino = de->d_ino;
+
+        array_push(*out, e);
+    }
+
+    _stat_entries(dr, dir_path, *out, uring_depth);
+
+    closedir(dr);
+
+    return 0;
 }
 
-static void _tree_view_select(void) {
-    file *f;
+static void _scan_job_free(scan_job *job) {
+    char **c_it;
 
-    f = *(file **)array_item(files, ys->active_frame->cursor_line);
+    array_traverse(job->hidden, c_it) {
+        free(*c_it);
+    }
+    array_free(job->hidden);
 
-    if (f->flags == IS_DIR) {
-        if (f->open_children) {
-            _tree_view_remove_dir(ys->active_frame->cursor_line);
+    if (!job->stat_only && job->status == 0) {
+        array_free(job->entries);
+    }
+
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+    free(job);
+}
+
+static void *_scan_worker(void *arg) {
+    scan_job *job;
+    int       abandoned;
+
+    job = arg;
+    if (job->stat_only) {
+        if (job->follow) {
+            job->status = stat(job->path, &job->st) == 0 ? 0 : -1;
         } else {
-            _tree_view_add_dir(ys->active_frame->cursor_line);
+            job->status = lstat(job->path, &job->st) == 0 ? 0 : -1;
         }
+        job->err = errno;
     } else {
-        YEXE("special-buffer-prepare-jump-focus", f->path);
-        YEXE("buffer", f->path);
+        job->status = _scan_dir(job->path, job->hidden, job->limit, job->uring_depth,
+                                &job->entries, &job->count);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->done = 1;
+    abandoned = job->abandoned;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+
+    /* nobody is waiting any more, so the result is ours to throw away */
+    if (abandoned) {
+        _scan_job_free(job);
     }
+
+    return NULL;
 }
 
-static void _tree_view_line_handler(yed_event *event) {
-    file       *f;
-    yed_attrs  *attr_tmp;
-    char       *color_var;
-    yed_attrs   attr_dir;
-    yed_attrs   attr_exec;
-    yed_attrs   attr_symb_link;
-    yed_attrs   attr_device;
-    yed_attrs   attr_graphic_img;
-    yed_attrs   attr_archive;
-    yed_attrs   attr_broken_link;
-    yed_attrs   attr_file;
-    int         loc;
-    int         base;
-    yed_line   *line;
+/*
+ * An abandoned scan worker can be stuck in the kernel for as long as the
+ * mount stays hung and still has our code to run when it returns, so once
+ * there is one the library is kept mapped for good, unload or not.
+ */
+static void _pin_library(void) {
+    static int pinned;
+    Dl_info    info;
 
-    if (event->frame         == NULL
-    ||  event->frame->buffer == NULL
-    ||  event->frame->buffer != _get_or_make_buff()) {
+    if (pinned) { return; }
+
+    if (dladdr((void *)_pin_library, &info) == 0 || info.dli_fname == NULL) { return; }
+
+    /* this handle is never closed; RTLD_NODELETE outlives the editor's own */
+    if (dlopen(info.dli_fname, RTLD_NOW | RTLD_NODELETE) != NULL) {
+        pinned = 1;
+    }
+}
+
+static scan_job *_scan_job_new(const char *path) {
+    scan_job           *job;
+    pthread_condattr_t  attr;
+
+    job = calloc(1, sizeof(scan_job));
+    strncat(job->path, path, sizeof(job->path) - 1);
+    job->status = -1;
+    job->hidden = array_make(char *);
+
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&job->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return job;
+}
+
+/*
+ * Runs job on a detached thread and waits up to tree-view-mount-timeout-ms
+ * for it.  Returns 0 once the job is done and 1 if no thread could be
+ * started; either way the job is still the caller's.  On timeout the mount
+ * is marked unresponsive, the job is left to the worker and -1 is returned.
+ */
+static int _scan_job_run(scan_job *job, mount_state *m) {
+    pthread_t        thread;
+    struct timespec  deadline;
+    time_t           now;
+    int              timeout_ms;
+    int              rc;
+
+    now = time(NULL);
+
+    if (pthread_create(&thread, NULL, _scan_worker, job) != 0) { return 1; }
+    pthread_detach(thread);
+
+    timeout_ms = atoi(yed_get_var("tree-view-mount-timeout-ms"));
+    if (timeout_ms <= 0) { timeout_ms = 2000; }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec  += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec  += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    rc = 0;
+    while (!job->done && rc != ETIMEDOUT) {
+        rc = pthread_cond_timedwait(&job->cond, &job->lock, &deadline);
+    }
+
+    if (!job->done) {
+        job->abandoned = 1;
+        pthread_mutex_unlock(&job->lock);
+
+        /* the worker may come back after we're unloaded */
+        _pin_library();
+
+        m->backoff      = m->backoff ? m->backoff * 2 : (wait_time > 0 ? wait_time : 1);
+        if (m->backoff > 300) { m->backoff = 300; }
+        m->retry_at     = now + m->backoff;
+        m->unresponsive = 1;
+        ys->redraw      = 1;
+
+        yed_cerr("tree-view: '%s' is not responding, retrying in %ds", job->path, m->backoff);
+
+        return -1;
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    if (m->unresponsive) {
+        m->unresponsive = 0;
+        m->backoff      = 0;
+        ys->redraw      = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Directories on a device other than the root's are read on a detached
+ * thread.  If that doesn't finish within tree-view-mount-timeout-ms the
+ * device is marked unresponsive and left alone until its backoff expires,
+ * so a hung NFS or FUSE mount can't stall the editor.  dev is the device
+ * of the directory itself, which for a symlink row isn't f->dev.
+ */
+static int _scan_dir_with_timeout(file *f, dev_t dev, int limit,
+                                  array_t *out, dir_count *count) {
+    mount_state  *m;
+    scan_job     *job;
+    char        **str_it;
+    char         *str;
+    int           status;
+    int           rc;
+
+    m = _mount_state(dev);
+
+    if (m->unresponsive && time(NULL) < m->retry_at) { return -1; }
+
+    job = _scan_job_new(f->path);
+    job->limit       = limit;
+    job->uring_depth = _uring_depth();
+    array_traverse(hidden_items, str_it) {
+        str = strdup(*str_it);
+        array_push(job->hidden, str);
+    }
+
+    if ((rc = _scan_job_run(job, m)) < 0) { return -1; }
+
+    if (rc > 0) {
+        _scan_job_free(job);
+        return _scan_dir(f->path, hidden_items, limit, _uring_depth(), out, count);
+    }
+
+    status = job->status;
+    *count = job->count;
+    if (status == 0) {
+        *out        = job->entries;
+        job->status = -1;
+    }
+    _scan_job_free(job);
+
+    return status;
+}
+
+/*
+ * A mount point is lstat'ed when its parent is listed, and that lookup
+ * crosses into the mount.  So it gets the same worker, timeout and backoff
+ * as a listing on the mount; until it answers, the entry stands in as an
+ * empty directory on dev.
+ */
+static void _stat_mount_point(const char *dir_path, dir_entry *e, dev_t dev) {
+    mount_state *m;
+    scan_job    *job;
+    char         path[1024];
+    ino_t        d_ino;
+    int          rc;
+
+    snprintf(path, sizeof(path), "%s/%s", dir_path, e->name);
+
+    d_ino = e->st.st_ino;
+    m     = _mount_state(dev);
+
+    if (!m->unresponsive || time(NULL) >= m->retry_at) {
+        job = _scan_job_new(path);
+        job->stat_only = 1;
+
+        if ((rc = _scan_job_run(job, m)) >= 0) {
+            if (rc > 0) {
+                job->status = lstat(path, &job->st) == 0 ? 0 : -1;
+            }
+
+            if (job->status == 0) {
+                e->st = job->st;
+            } else {
+                memset(&e->st, 0, sizeof(e->st));
+            }
+            _scan_job_free(job);
+
+            return;
+        }
+    }
+
+    memset(&e->st, 0, sizeof(e->st));
+    e->st.st_mode = S_IFDIR | 0555;
+    e->st.st_dev  = dev;
+    e->st.st_ino  = d_ino;
+}
+
+/*
+ * Reads the mount table from /proc/self/mountinfo.  The kernel flags the
+ * open file with POLLPRI when the table changes, so it is only re-read
+ * then.  Reading it never touches the mounts themselves.
+ */
+static void _mount_points_load(void) {
+    struct pollfd  pfd;
+    mount_point    mp;
+    unsigned       major;
+    unsigned       minor;
+    char          *buff;
+    char          *line;
+    char          *next;
+    char           field[1024];
+    char          *src;
+    char          *dst;
+    int            cap;
+    int            len;
+    int            n;
+
+    if (mountinfo_fd < 0) {
+        if ((mountinfo_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC)) < 0) {
+            return;
+        }
+    } else {
+        pfd.fd      = mountinfo_fd;
+        pfd.events  = POLLPRI;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLPRI | POLLERR))) {
+            return;
+        }
+    }
+
+    cap  = 16384;
+    len  = 0;
+    buff = malloc(cap);
+
+    lseek(mountinfo_fd, 0, SEEK_SET);
+    while ((n = read(mountinfo_fd, buff + len, cap - len - 1)) > 0) {
+        len += n;
+        if (len == cap - 1) {
+            cap  *= 2;
+            buff  = realloc(buff, cap);
+        }
+    }
+    buff[len] = 0;
+
+    array_clear(mount_points);
+
+    /* id parent major:minor root mount-point ... */
+    for (line = buff; line && *line; line = next) {
+        if ((next = strchr(line, '\n')) != NULL) { *next++ = 0; }
+
+        if (sscanf(line, "%*d %*d %u:%u %*s %1023s", &major, &minor, field) != 3) {
+            continue;
+        }
+
+        /* spaces and the like come octal-escaped */
+        memset(&mp, 0, sizeof(mp));
+        for (src = field, dst = mp.path; *src; dst++) {
+            if (src[0] == '\\'
+            &&  src[1] >= '0' && src[1] <= '7'
+            &&  src[2] >= '0' && src[2] <= '7'
+            &&  src[3] >= '0' && src[3] <= '7') {
+                *dst  = ((src[1] - '0') << 6) | ((src[2] - '0') << 3) | (src[3] - '0');
+                src  += 4;
+            } else {
+                *dst = *src++;
+            }
+        }
+
+        if (strcmp(mp.path, "/") == 0) { continue; }
+
+        mp.dev = makedev(major, minor);
+        array_push(mount_points, mp);
+    }
+
+    free(buff);
+}
+
+/* Is abs_dir/name a mount point?  If so, dev is the device mounted there. */
+static int _mount_point_dev(const char *abs_dir, const char *name, dev_t *dev) {
+    mount_point *mp;
+    const char  *rest;
+    int          dir_len;
+
+    dir_len = strlen(abs_dir);
+    if (dir_len == 1) { dir_len = 0; } /* "/" */
+
+    array_traverse(mount_points, mp) {
+        if (strncmp(mp->path, abs_dir, dir_len) != 0 || mp->path[dir_len] != '/') {
+            continue;
+        }
+
+        rest = mp->path + dir_len + 1;
+        if (strcmp(rest, name) == 0) {
+            *dev = mp->dev;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Queue depth for the io_uring statx backend, or 0 for plain lstat(). */
+static int _uring_depth(void) {
+    char *backend;
+    int   depth;
+
+    backend = yed_get_var("tree-view-stat-backend");
+    if (backend == NULL || strcmp(backend, "uring") != 0) { return 0; }
+
+    depth = atoi(yed_get_var("tree-view-uring-depth"));
+
+    return depth > 0 ? depth : 64;
+}
+
+/* On the editor thread, pass target: a link's target is then stat'ed
+ * through _stat_link_target() and left there (st_mode 0 if unknown). */
+static void _stat_entry(const char *dir_path, dir_entry *e, struct stat *target) {
+    struct stat tmp;
+    char        path[1024];
+    int         status;
+
+    snprintf(path, sizeof(path), "%s/%s", dir_path, e->name);
+
+    if (target) {
+        memset(target, 0, sizeof(*target));
+    }
+
+    if (lstat(path, &e->st) != 0) {
+        memset(&e->st, 0, sizeof(e->st));
+        return;
+    }
+
+    if (!S_ISLNK(e->st.st_mode)) { return; }
+
+    if (target) {
+        status = _stat_link_target(path, e->st.st_dev, target);
+    } else {
+        status = stat(path, &tmp) == 0 ? 0 : -1;
+    }
+
+    if (status == -1 && errno == ENOENT) {
+        e->broken = 1;
+    }
+}
+
+/* Lexically resolves "." and ".." in an absolute path, in place. */
+static void _clean_abs_path(char *path) {
+    char *src;
+    char *dst;
+    char *seg;
+    int   len;
+
+    src = dst = path;
+    while (*src) {
+        while (*src == '/') { src++; }
+        if (!*src) { break; }
+
+        seg = src;
+        while (*src && *src != '/') { src++; }
+        len = src - seg;
+
+        if (len == 1 && seg[0] == '.') { continue; }
+
+        if (len == 2 && seg[0] == '.' && seg[1] == '.') {
+            while (dst > path && *--dst != '/') {}
+            continue;
+        }
+
+        *dst++ = '/';
+        memmove(dst, seg, len);
+        dst += len;
+    }
+
+    if (dst == path) { *dst++ = '/'; }
+    *dst = 0;
+}
+
+/*
+ * The device a symlink's target lives on, judged from the link text and
+ * the mount table alone so that nothing on the far side is touched.  0 if
+ * the target is on the root filesystem or it can't be told.  Links along
+ * the way aren't followed, so this is a best guess.
+ */
+static dev_t _link_target_dev(const char *path) {
+    mount_point *mp;
+    dev_t        dev;
+    char         link[512];
+    char         abs[2048];
+    char         fd_path[64];
+    char         dir[1024];
+    char        *slash;
+    ssize_t      len;
+    int          best;
+    int          mp_len;
+    int          fd;
+
+    _mount_points_load();
+    if (array_len(mount_points) == 0) { return 0; }
+
+    if ((len = readlink(path, link, sizeof(link) - 1)) < 0) { return 0; }
+    link[len] = 0;
+
+    if (link[0] == '/') {
+        snprintf(abs, sizeof(abs), "%s", link);
+    } else {
+        /* the directory holding the link has been listed, so it answers */
+        snprintf(dir, sizeof(dir), "%s", path);
+        if ((slash = strrchr(dir, '/')) != NULL) {
+            *slash = 0;
+        } else {
+            strcpy(dir, ".");
+        }
+
+        if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) { return 0; }
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+        len = readlink(fd_path, dir, sizeof(dir) - 1);
+        close(fd);
+        if (len <= 0) { return 0; }
+        dir[len] = 0;
+
+        snprintf(abs, sizeof(abs), "%s/%s", dir, link);
+    }
+
+    _clean_abs_path(abs);
+
+    dev  = 0;
+    best = 0;
+    array_traverse(mount_points, mp) {
+        mp_len = strlen(mp->path);
+        if (mp_len > best
+        &&  strncmp(abs, mp->path, mp_len) == 0
+        &&  (abs[mp_len] == '/' || abs[mp_len] == 0)) {
+            best = mp_len;
+            dev  = mp->dev;
+        }
+    }
+
+    return dev;
+}
+
+/*
+ * stat() a symlink's target from the editor thread.  A target that looks to
+ * be on another mount than the link is stat'ed on a worker under that
+ * mount's timeout and backoff.  Returns 0 or -1 (with errno) like stat(),
+ * or -2 if the mount didn't answer; out->st_dev then names it.
+ */
+static int _stat_link_target(const char *path, dev_t link_dev, struct stat *out) {
+    mount_state *m;
+    scan_job    *job;
+    dev_t        dev;
+    int          status;
+    int          rc;
+
+    dev = _link_target_dev(path);
+
+    if (dev == 0 || dev == link_dev) {
+        return stat(path, out) == 0 ? 0 : -1;
+    }
+
+    memset(out, 0, sizeof(*out));
+    out->st_dev = dev;
+
+    m = _mount_state(dev);
+    if (m->unresponsive && time(NULL) < m->retry_at) { return -2; }
+
+    job = _scan_job_new(path);
+    job->stat_only = 1;
+    job->follow    = 1;
+
+    if ((rc = _scan_job_run(job, m)) < 0) { return -2; }
+
+    if (rc > 0) {
+        job->status = stat(path, &job->st) == 0 ? 0 : -1;
+        job->err    = errno;
+    }
+
+    status = job->status;
+    if (status == 0) {
+        *out = job->st;
+    }
+    errno = job->err;
+    _scan_job_free(job);
+
+    return status;
+}
+
+#ifdef TREE_VIEW_URING
+static int _uring_init(uring *r, unsigned depth) {
+    struct io_uring_params p;
+    char                  *sq;
+    char                  *cq;
+
+    memset(r, 0, sizeof(uring));
+    memset(&p, 0, sizeof(p));
+
+    if ((r->fd = syscall(__NR_io_uring_setup, depth, &p)) < 0) { return -1; }
+
+    r->depth = p.sq_entries;
+    r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_sz = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_sz > r->sq_sz) { r->sq_sz = r->cq_sz; }
+        r->cq_sz = 0;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) { goto err_fd; }
+
+    if (r->cq_sz) {
+        r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) { goto err_sq; }
+    } else {
+        r->cq_ptr = r->sq_ptr;
+    }
+
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes    = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) { goto err_cq; }
+
+    sq = r->sq_ptr;
+    cq = r->cq_ptr;
+
+    r->sq_head  = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+
+err_cq:;
+    if (r->cq_sz) { munmap(r->cq_ptr, r->cq_sz); }
+err_sq:;
+    munmap(r->sq_ptr, r->sq_sz);
+err_fd:;
+    close(r->fd);
+    r->fd = -1;
+
+    return -1;
+}
+
+static void _uring_exit(uring *r) {
+    if (r->fd <= 0) { return; }
+
+    munmap(r->sqes, r->sqes_sz);
+    if (r->cq_sz) { munmap(r->cq_ptr, r->cq_sz); }
+    munmap(r->sq_ptr, r->sq_sz);
+    close(r->fd);
+
+    r->fd = -1;
+}
+
+/* Take whatever completions are ready.  Returns how many there were. */
+static int _uring_reap(uring *r, array_t entries, struct statx *stx, char *done) {
+    struct io_uring_cqe *cqe;
+    dir_entry           *e;
+    unsigned             head;
+    unsigned             idx;
+    int                  n;
+
+    n    = 0;
+    head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &r->cqes[head & *r->cq_mask];
+        idx = cqe->user_data;
+
+        if (cqe->res == 0) {
+            e = array_item(entries, idx);
+            e->st.st_mode  = stx[idx].stx_mode;
+            e->st.st_size  = stx[idx].stx_size;
+            e->st.st_mtime = stx[idx].stx_mtime.tv_sec;
+            e->st.st_ino   = stx[idx].stx_ino;
+            e->st.st_dev   = makedev(stx[idx].stx_dev_major, stx[idx].stx_dev_minor);
+            e->st.st_nlink = stx[idx].stx_nlink;
+            done[idx]      = 1;
+        }
+
+        head += 1;
+        n    += 1;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+/*
+ * Issue one statx per entry through the ring, keeping at most depth of them
+ * in flight.  Entries whose statx fails (including kernels without
+ * IORING_OP_STATX) are left for the synchronous path; returns -1 if the ring
+ * itself broke.
+ */
+static int _uring_stat_entries(uring *r, int dir_fd, array_t entries, char *done) {
+    struct io_uring_sqe *sqe;
+    struct statx        *stx;
+    dir_entry           *e;
+    unsigned             tail;
+    unsigned             idx;
+    int                  n;
+    int                  submitted;
+    int                  completed;
+    int                  in_flight;
+    int                  to_submit;
+    int                  reaped;
+    int                  status;
+
+    n      = array_len(entries);
+    stx    = calloc(n, sizeof(struct statx));
+    status = 0;
+
+    submitted = completed = in_flight = 0;
+    while (completed < n) {
+        tail = *r->sq_tail;
+        while (submitted < n && in_flight < (int)r->depth) {
+            if (done[submitted]) {
+                submitted += 1;
+                completed += 1;
+                continue;
+            }
+
+            e   = array_item(entries, submitted);
+            idx = tail & *r->sq_mask;
+            sqe = &r->sqes[idx];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode      = IORING_OP_STATX;
+            sqe->fd          = dir_fd;
+            sqe->addr        = (unsigned long)e->name;
+            sqe->len         = STATX_BASIC_STATS;
+            sqe->off         = (unsigned long)&stx[submitted];
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            sqe->user_data   = submitted;
+
+            r->sq_array[idx] = idx;
+            tail            += 1;
+            submitted       += 1;
+            in_flight       += 1;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+        /* includes any the kernel didn't take on an interrupted enter */
+        to_submit = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+        /* the rest came from the metadata cache */
+        if (in_flight == 0) { break; }
+
+        if (syscall(__NR_io_uring_enter, r->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            if (errno == EINTR) { continue; }
+            status = -1;
+            break;
+        }
+
+        reaped     = _uring_reap(r, entries, stx, done);
+        completed += reaped;
+        in_flight -= reaped;
+    }
+
+    if (status != 0) {
+        /*
+         * Closing the ring doesn't stop statx calls already running, and
+         * they still point at stx and the entry names.  Take back what
+         * the kernel never picked up and wait out the rest.
+         */
+        in_flight -= tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        __atomic_store_n(r->sq_tail, *r->sq_head, __ATOMIC_RELEASE);
+
+        while (in_flight > 0) {
+            if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+            &&  errno != EINTR) {
+                usleep(1000);
+            }
+            in_flight -= _uring_reap(r, entries, stx, done);
+        }
+
+        _uring_exit(r);
+    }
+    free(stx);
+
+    return status;
+}
+#endif
+
+/* Fill in the stat results for a directory's entries using the requested
+ * backend, falling back to plain lstat() wherever it can't. */
+static void _stat_entries(DIR *dr, const char *dir_path, array_t entries, int uring_depth) {
+    dir_entry   *e;
+    meta        *m;
+    struct stat  dir_st;
+    struct stat  target;
+    char        *done;
+    dev_t       *mount_devs;
+    char         fd_path[64];
+    char         abs_dir[1024];
+    ssize_t      abs_len;
+    int          use_meta;
+    int          i;
+#ifdef TREE_VIEW_URING
+    uring      local;
+    uring     *r;
+    int        own;
+#endif
+
+    done       = calloc(array_len(entries) + 1, 1);
+    mount_devs = NULL;
+
+    /* the metadata cache belongs to the editor thread; until stat'ed,
+     * st_ino holds the entry's d_ino */
+    use_meta = pthread_equal(pthread_self(), main_thread) && fstat(dirfd(dr), &dir_st) == 0;
+
+    /* Mount points must not be lstat'ed here, so pick them out first.
+     * Worker threads don't bother: they're already allowed to hang. */
+    if (use_meta) {
+        _mount_points_load();
+
+        if (array_len(mount_points) > 0) {
+            snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", dirfd(dr));
+            abs_len = readlink(fd_path, abs_dir, sizeof(abs_dir) - 1);
+            if (abs_len > 0) {
+                abs_dir[abs_len] = 0;
+                mount_devs       = calloc(array_len(entries) + 1, sizeof(dev_t));
+
+                /* bind mounts of this same filesystem are safe to lstat */
+                i = 0;
+                array_traverse(entries, e) {
+                    if (_mount_point_dev(abs_dir, e->name, &mount_devs[i])
+                    &&  mount_devs[i] != dir_st.st_dev) {
+                        done[i] = 3;
+                    }
+                    i++;
+                }
+            }
+        }
+    }
+
+    if (use_meta) {
+        i = 0;
+        array_traverse(entries, e) {
+            if (done[i]) {
+                i++;
+                continue;
+            }
+
+            m = _meta_find(dir_st.st_dev, e->st.st_ino);
+            if (m != NULL
+            &&  m->epoch == meta_epoch
+            &&  (m->name_hash == _hash_path(e->name)
+                 || (m->st.st_nlink > 1 && !S_ISDIR(m->st.st_mode)))) {
+                e->st     = m->st;
+                e->broken = m->broken;
+                done[i]   = 2;
+            }
+            i++;
+        }
+    }
+
+#ifdef TREE_VIEW_URING
+    if (uring_depth > 0 && array_len(entries) > 1
+    &&  !__atomic_load_n(&uring_unavailable, __ATOMIC_RELAXED)) {
+        /* the editor thread keeps its ring; scan workers make their own */
+        own = !pthread_equal(pthread_self(), main_thread);
+        r   = own ? &local : &main_ring;
+
+        if (own || main_ring.fd <= 0 || main_ring_depth != uring_depth) {
+            if (!own) { _uring_exit(&main_ring); }
+            if (_uring_init(r, uring_depth) != 0) {
+                /* don't pay for a failing setup on every scan */
+                r->fd = -1;
+                __atomic_store_n(&uring_unavailable, 1, __ATOMIC_RELAXED);
+            } else if (!own) {
+                main_ring_depth = uring_depth;
+            }
+        }
+
+        if (r->fd > 0) {
+            _uring_stat_entries(r, dirfd(dr), entries, done);
+        }
+
+        if (own) { _uring_exit(r); }
+    }
+#else
+    (void)dr;
+    (void)uring_depth;
+#endif
+
+    i = 0;
+    array_traverse(entries, e) {
+        if (done[i] == 2) {
+            i++;
+            continue;
+        }
+
+        if (done[i] == 3) {
+            _stat_mount_point(dir_path, e, mount_devs[i]);
+            i++;
+            continue;
+        }
+
+        memset(&target, 0, sizeof(target));
+        if (!done[i] || S_ISLNK(e->st.st_mode)) {
+            /* for a statx'd link, only the broken check is left */
+            _stat_entry(dir_path, e, use_meta ? &target : NULL);
+        }
+
+        if (use_meta && e->st.st_ino != 0) {
+            _meta_store(dir_path, e, &target);
+        }
+        i++;
+    }
+
+    free(mount_devs);
+    free(done);
+}
+
+static unsigned long long _now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
+static void _tree_view_stat_bench(int n_args, char **args) {
+    array_t             entries;
+    array_t             empty;
+    dir_count           count;
+    unsigned long long  start;
+    unsigned long long  us;
+    int                 depth;
+    int                 status;
+
+    /* One backend per run: whichever went second would find the first one's
+     * inodes already cached.  Drop the page cache between runs
+     * (echo 3 > /proc/sys/vm/drop_caches) to compare cold scans. */
+    if (n_args != 2) {
+        yed_cerr("expected 2 arguments, but got %d", n_args);
+        return;
+    }
+
+    if (strcmp(args[1], "uring") == 0) {
+        depth = atoi(yed_get_var("tree-view-uring-depth"));
+        if (depth <= 0) { depth = 64; }
+    } else if (strcmp(args[1], "sync") == 0) {
+        depth = 0;
+    } else {
+        yed_cerr("tree-view-stat-bench: backend must be 'uring' or 'sync'");
+        return;
+    }
+
+    empty = array_make(char *);
+
+    /* so that every entry really is stat'ed */
+    _metas_invalidate();
+
+    start  = _now_us();
+    status = _scan_dir(args[0], empty, -1, depth, &entries, &count);
+    us     = _now_us() - start;
+
+    if (status == 0) {
+        yed_cprint("tree-view-stat-bench: %s %d entries in %llu us",
+                   args[1], array_len(entries), us);
+        array_free(entries);
+    } else {
+        yed_cerr("tree-view-stat-bench: could not read '%s'", args[0]);
+    }
+
+#ifdef TREE_VIEW_URING
+    if (depth > 0 && uring_unavailable) {
+        yed_cerr("tree-view-stat-bench: io_uring is unavailable, that was lstat()");
+    }
+#else
+    if (depth > 0) {
+        yed_cerr("tree-view-stat-bench: built without io_uring, that was lstat()");
+    }
+#endif
+
+    array_free(empty);
+}
+
+/* How many entries f may expand to before it is summarized instead,
+ * or -1 for no limit.  own_rows are rows under f already counted in the
+ * tree that its new entries would replace. */
+static int _dir_limit(file *f, int own_rows) {
+    int limit;
+    int max_entries;
+    int max_nodes;
+    int remaining;
+
+    if (_is_forced(f->path)) { return -1; }
+
+    if (f->num_tabs >= 0
+    &&  _matches_patterns(yed_get_var("tree-view-lazy-patterns"), f->name)) {
+        return 0;
+    }
+
+    limit       = -1;
+    max_entries = atoi(yed_get_var("tree-view-max-dir-entries"));
+    max_nodes   = atoi(yed_get_var("tree-view-max-nodes"));
+
+    if (max_entries > 0) {
+        limit = max_entries;
+    }
+
+    if (max_nodes > 0) {
+        remaining = max_nodes - array_len(files) + own_rows;
+        if (remaining < 0) { remaining = 0; }
+        if (limit < 0 || remaining < limit) {
+            limit = remaining;
+        }
+    }
+
+    return limit;
+}
+
+static void _fmt_count(int n, char *out) {
+    char digits[32];
+    int  len;
+    int  i;
+    int  j;
+
+    len = snprintf(digits, sizeof(digits), "%d", n);
+
+    j = 0;
+    for (i = 0; i < len; i++) {
+        if (i > 0 && (len - i) % 3 == 0) {
+            out[j++] = ',';
+        }
+        out[j++] = digits[i];
+    }
+    out[j] = 0;
+}
+
+static void _tree_view_add_summary(int idx, dir_count *count) {
+    yed_buffer *buff;
+    file       *f;
+    file       *new_f;
+    char        n_entries[48];
+    char        n_dirs[48];
+    char        path[1024];
+    char        name[512];
+    char        write_name[1024];
+
+    buff = _get_or_make_buff();
+    f    = *(file **)array_item(files, idx);
+
+    _fmt_count(count->entries, n_entries);
+    _fmt_count(count->dirs, n_dirs);
+
+    snprintf(name, sizeof(name), "%s entries (%s dirs) — press ENTER to load anyway",
+             n_entries, n_dirs);
+    /* the trailing slash keeps this out of path lookups */
+    snprintf(path, sizeof(path), "%s/", f->path);
+
+    new_f = _init_file(idx, path, name, IS_SUMMARY, f->num_tabs+1, 0);
+
+    buff->flags &= ~BUFF_RD_ONLY;
+
+    if (idx+1 > 1) {
+        yed_buff_insert_line_no_undo(buff, idx+1);
+    }
+
+    new_f->color_loc = _tree_view_row_text(new_f, 1, write_name);
+    yed_buff_insert_string_no_undo(buff, write_name, idx+1, 1);
+
+    if (idx+1 >= array_len(files)) {
+        array_push(files, new_f);
+    } else {
+        array_insert(files, idx+1, new_f);
+    }
+
+    f->open_children = 1;
+
+    buff->flags |= BUFF_RD_ONLY;
+
+    _tree_view_changed();
+}
+
+/* ENTER on a summary row: load its directory regardless of the limits. */
+static void _tree_view_load_anyway(int idx) {
+    file *f;
+    int   dir_idx;
+
+    f = *(file **)array_item(files, idx);
+
+    for (dir_idx = idx - 1; dir_idx >= 0; dir_idx--) {
+        if ((*(file **)array_item(files, dir_idx))->num_tabs < f->num_tabs) {
+            break;
+        }
+    }
+    if (dir_idx < 0) { return; }
+
+    f = *(file **)array_item(files, dir_idx);
+    _set_forced(f->path, 1);
+
+    _tree_view_remove_dir(dir_idx);
+    _tree_view_add_dir(dir_idx);
+}
+
+static int _is_hidden(array_t hidden, const char *name) {
+    char **str_it;
+
+    array_traverse(hidden, str_it) {
+        if (strstr(name, (*str_it))) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int _matches_patterns(const char *patterns, const char *name) {
+    char *copy;
+    char *token;
+    char *save;
+    int   match;
+
+    if (patterns == NULL || *patterns == 0) { return 0; }
+
+    copy  = strdup(patterns);
+    match = 0;
+
+    for (token = strtok_r(copy, " ", &save); token; token = strtok_r(NULL, " ", &save)) {
+        if (fnmatch(token, name, 0) == 0) {
+            match = 1;
+            break;
+        }
+    }
+
+    free(copy);
+
+    return match;
+}
+
+static int _is_forced(const char *path) {
+    char **c_it;
+
+    array_traverse(forced_dirs, c_it) {
+        if (strcmp(*c_it, path) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void _set_forced(const char *path, int forced) {
+    char **c_it;
+    char  *str;
+    int    i;
+
+    i = 0;
+    array_traverse(forced_dirs, c_it) {
+        if (strcmp(*c_it, path) == 0) {
+            if (!forced) {
+                free(*c_it);
+                array_delete(forced_dirs, i);
+            }
+            return;
+        }
+        i++;
+    }
+
+    if (forced) {
+        str = strdup(path);
+        array_push(forced_dirs, str);
+    }
+}
+
+static unsigned long _hash_inode(dev_t dev, ino_t ino) {
+    return (unsigned long)(ino * 2654435761UL) ^ (unsigned long)dev;
+}
+
+static listing *_listing_find(dev_t dev, ino_t ino) {
+    listing *l;
+    int      slot;
+
+    if (listings_cap == 0 || ino == 0) { return NULL; }
+
+    slot = _hash_inode(dev, ino) & (listings_cap - 1);
+    while ((l = listings[slot]) != NULL) {
+        if (l->dev == dev && l->ino == ino) {
+            return l;
+        }
+        slot = (slot + 1) & (listings_cap - 1);
+    }
+
+    return NULL;
+}
+
+/* Takes ownership of entries.  Returns NULL (and leaves entries to the
+ * caller) when the directory has no usable inode. */
+static listing *_listing_store(dir_id *id, array_t entries) {
+    listing   **old;
+    listing    *l;
+    dir_entry  *e_it;
+    int         old_cap;
+    int         slot;
+    int         i;
+
+    if (id->ino == 0) { return NULL; }
+
+    if ((l = _listing_find(id->dev, id->ino)) == NULL) {
+        if ((listings_len + 1) * 2 > listings_cap) {
+            old     = listings;
+            old_cap = listings_cap;
+
+            listings_cap = old_cap ? old_cap * 2 : 64;
+            listings     = calloc(listings_cap, sizeof(listing *));
+
+            for (i = 0; i < old_cap; i++) {
+                if (old[i] == NULL) { continue; }
+                slot = _hash_inode(old[i]->dev, old[i]->ino) & (listings_cap - 1);
+                while (listings[slot]) {
+                    slot = (slot + 1) & (listings_cap - 1);
+                }
+                listings[slot] = old[i];
+            }
+            free(old);
+        }
+
+        l      = calloc(1, sizeof(listing));
+        l->dev = id->dev;
+        l->ino = id->ino;
+
+        slot = _hash_inode(id->dev, id->ino) & (listings_cap - 1);
+        while (listings[slot]) {
+            slot = (slot + 1) & (listings_cap - 1);
+        }
+        listings[slot] = l;
+        listings_len  += 1;
+    } else {
+        array_free(l->entries);
+    }
+
+    l->mtim    = id->mtim;
+    l->entries = entries;
+
+    memset(&l->count, 0, sizeof(l->count));
+    array_traverse(entries, e_it) {
+        l->count.entries += 1;
+        if (S_ISDIR(e_it->st.st_mode)) {
+            l->count.dirs += 1;
+        }
+    }
+
+    return l;
+}
+
+static void _listings_clear(void) {
+    int i;
+
+    for (i = 0; i < listings_cap; i++) {
+        if (listings[i] == NULL) { continue; }
+        array_free(listings[i]->entries);
+        free(listings[i]);
+    }
+    free(listings);
+
+    listings     = NULL;
+    listings_cap = 0;
+    listings_len = 0;
+}
+
+static meta *_meta_find(dev_t dev, ino_t ino) {
+    meta *m;
+    int   slot;
+
+    if (metas_cap == 0 || ino == 0) { return NULL; }
+
+    slot = _hash_inode(dev, ino) & (metas_cap - 1);
+    while ((m = metas[slot]) != NULL) {
+        if (m->dev == dev && m->ino == ino) {
+            return m;
+        }
+        slot = (slot + 1) & (metas_cap - 1);
+    }
+
+    return NULL;
+}
+
+/* Records a freshly stat'ed entry.  For a link, also what it points to. */
+/* target is what _stat_entry() found for a link; st_mode 0 if unknown. */
+static void _meta_store(const char *dir_path, dir_entry *e, struct stat *target) {
+    meta        **old;
+    meta         *m;
+    char          path[1024];
+    char          link[512];
+    ssize_t       len;
+    int           old_cap;
+    int           slot;
+    int           i;
+
+    if ((m = _meta_find(e->st.st_dev, e->st.st_ino)) == NULL) {
+        if ((metas_len + 1) * 2 > metas_cap) {
+            old     = metas;
+            old_cap = metas_cap;
+
+            metas_cap = old_cap ? old_cap * 2 : 256;
+            metas     = calloc(metas_cap, sizeof(meta *));
+
+            for (i = 0; i < old_cap; i++) {
+                if (old[i] == NULL) { continue; }
+                slot = _hash_inode(old[i]->dev, old[i]->ino) & (metas_cap - 1);
+                while (metas[slot]) {
+                    slot = (slot + 1) & (metas_cap - 1);
+                }
+                metas[slot] = old[i];
+            }
+            free(old);
+        }
+
+        m      = calloc(1, sizeof(meta));
+        m->dev = e->st.st_dev;
+        m->ino = e->st.st_ino;
+
+        slot = _hash_inode(m->dev, m->ino) & (metas_cap - 1);
+        while (metas[slot]) {
+            slot = (slot + 1) & (metas_cap - 1);
+        }
+        metas[slot] = m;
+        metas_len  += 1;
+    }
+
+    m->epoch     = meta_epoch;
+    m->name_hash = _hash_path(e->name);
+    m->st        = e->st;
+    m->broken    = e->broken;
+
+    free(m->link);
+    m->link        = NULL;
+    m->target_mode = 0;
+    m->target_dev  = 0;
+
+    if (!S_ISLNK(e->st.st_mode)) { return; }
+
+    snprintf(path, sizeof(path), "%s/%s", dir_path, e->name);
+
+    if ((len = readlink(path, link, sizeof(link) - 1)) >= 0) {
+        link[len] = 0;
+        m->link   = strdup(link);
+    }
+
+    /* kept even when unknown, so the row can show the mount as down */
+    m->target_dev = target->st_dev;
+
+    if (!e->broken && target->st_mode != 0) {
+        m->target_mode  = target->st_mode;
+        m->target_ino   = target->st_ino;
+        m->target_mtime = target->st_mtime;
+    }
+}
+
+/* Called when the tree is refreshed: entries stay for display (link
+ * targets) but are no longer trusted by scans. */
+static void _metas_invalidate(void) {
+    meta_epoch += 1;
+
+    /* don't let inodes that are long gone pile up */
+    if (metas_len > 4 * array_len(files) + 4096) {
+        _metas_clear();
+    }
+}
+
+static void _metas_clear(void) {
+    int i;
+
+    for (i = 0; i < metas_cap; i++) {
+        if (metas[i] == NULL) { continue; }
+        free(metas[i]->link);
+        free(metas[i]);
+    }
+    free(metas);
+
+    metas     = NULL;
+    metas_cap = 0;
+    metas_len = 0;
+}
+
+/* Fills out with the directory f shows.  Returns -1 if f is not (or no
+ * longer links to) a directory. */
+static int _dir_id_of(file *f, dir_id *out) {
+    struct stat  st;
+    meta        *m;
+
+    memset(&out->mtim, 0, sizeof(out->mtim));
+
+    if (f->flags == IS_DIR) {
+        out->dev          = f->dev;
+        out->ino          = f->ino;
+        out->mtim.tv_sec  = f->mtime;
+        return 0;
+    }
+
+    if (f->flags != IS_LINK) { return -1; }
+
+    m = _meta_find(f->dev, f->ino);
+    if (m != NULL && m->epoch == meta_epoch && m->link != NULL) {
+        if (!S_ISDIR(m->target_mode)) { return -1; }
+
+        out->dev          = m->target_dev;
+        out->ino          = m->target_ino;
+        out->mtim.tv_sec  = m->target_mtime;
+        return 0;
+    }
+
+    /* the target may sit on a mount that has stopped answering */
+    if (_stat_link_target(f->path, f->dev, &st) != 0 || !S_ISDIR(st.st_mode)) { return -1; }
+
+    out->dev   = st.st_dev;
+    out->ino   = st.st_ino;
+    out->mtim  = st.st_mtim;
+    return 0;
+}
+
+/*
+ * The cached listing of the directory f shows, if it is still current.
+ * The mtime in id dates from when the row was made, so the directory is
+ * stat'ed again and compared to the nanosecond; id is updated for storing a
+ * new listing.  That stat is only done on the root's device, which isn't
+ * expected to hang -- elsewhere the directory is always read afresh.
+ */
+static listing *_listing_current(file *f, dir_id *id) {
+    listing     *l;
+    struct stat  st;
+
+    if (id->dev != f->top_dev) { return NULL; }
+
+    if (stat(f->path, &st) != 0 || st.st_dev != id->dev || st.st_ino != id->ino) {
+        return NULL;
+    }
+    id->mtim = st.st_mtim;
+
+    if ((l = _listing_find(id->dev, id->ino)) == NULL) { return NULL; }
+
+    if (l->mtim.tv_sec  != id->mtim.tv_sec
+    ||  l->mtim.tv_nsec != id->mtim.tv_nsec) {
+        return NULL;
+    }
+
+    return l;
+}
+
+static void _set_roots_var(void) {
+    char **c_it;
+    char   buff[4096];
+
+    memset(buff, 0, sizeof(buff));
+    array_traverse(roots, c_it) {
+        if (buff[0]) {
+            strncat(buff, " ", sizeof(buff) - strlen(buff) - 1);
+        }
+        strncat(buff, *c_it, sizeof(buff) - strlen(buff) - 1);
+    }
+
+    setting_roots = 1;
+    yed_set_var("tree-view-roots", buff);
+    setting_roots = 0;
+}
+
+/* Is path root or something below it?  Both are normalized, so this is
+ * a matter of whole leading components. */
+static int _path_within(const char *path, const char *root) {
+    int len;
+
+    if (strcmp(root, ".") == 0) {
+        return strcmp(path, ".") == 0 || strncmp(path, "./", 2) == 0;
+    }
+
+    len = strlen(root);
+
+    return strncmp(path, root, len) == 0
+        && (path[len] == 0 || path[len] == '/' || root[len - 1] == '/');
+}
+
+/* Is path inside one of the other roots? */
+static int _root_is_nested(const char *path) {
+    char **c_it;
+
+    array_traverse(roots, c_it) {
+        if (strcmp(*c_it, path) != 0 && _path_within(path, *c_it)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Expands every loaded directory on the way down to path, and path
+ * itself.  Returns its row, or -1 if it isn't in the tree. */
+static int _tree_view_open_path(const char *path) {
+    char  buff[512];
+    char *slash;
+    file *f;
+    int   idx;
+
+    memset(buff, 0, sizeof(buff));
+    strncat(buff, path, sizeof(buff) - 1);
+
+    slash = buff;
+    do {
+        if ((slash = strchr(slash + 1, '/')) != NULL) { *slash = 0; }
+
+        /* leading components above a root aren't in the tree */
+        if ((idx = _find_file(buff)) > 0) {
+            f = *(file **)array_item(files, idx);
+            if ((f->flags == IS_DIR || f->flags == IS_LINK) && !f->open_children) {
+                _tree_view_add_dir(idx);
+            }
+        }
+
+        if (slash) { *slash = '/'; }
+    } while (slash);
+
+    return _find_file(path);
+}
+
+/*
+ * Rows are told apart by path, so no root may sit inside another: their
+ * rows would share paths.  Adding a directory that is already in the tree
+ * just opens it there, and adding one that holds existing roots takes them
+ * in.
+ */
+static void _tree_view_add_root(int n_args, char **args) {
+    file         *f;
+    char        **c_it;
+    char         *str;
+    char          path[512];
+    struct stat   statbuf;
+    array_t       merged;
+    int           idx;
+    int           i;
+    int           was_plain;
+
+    if (n_args != 1) {
+        yed_cerr("expected 1 argument, but got %d", n_args);
+        return;
+    }
+
+    /* stored the way the query API spells paths */
+    _normalize_path(args[0], path);
+
+    if (stat(path, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode)) {
+        yed_cerr("tree-view: '%s' is not a directory", path);
+        return;
+    }
+
+    array_traverse(roots, c_it) {
+        if (strcmp(*c_it, path) == 0) { return; }
+    }
+
+    was_plain = array_len(roots) == 0;
+
+    if (was_plain ? _path_within(path, ".") : _root_is_nested(path)) {
+        if (_tree_view_open_path(path) >= 0) {
+            yed_cprint("tree-view: '%s' is already in the tree", path);
+        }
+        return;
+    }
+
+    merged = array_make(char *);
+    for (i = 0; i < array_len(roots); i++) {
+        c_it = array_item(roots, i);
+        if (_path_within(*c_it, path)) {
+            array_push(merged, *c_it);
+            array_delete(roots, i);
+            i -= 1;
+        }
+    }
+
+    /* the implicit "." becomes an explicit root of its own */
+    if (was_plain) {
+        str = strdup(".");
+        array_push(roots, str);
+    }
+
+    str = strdup(path);
+    array_push(roots, str);
+    _set_roots_var();
+
+    _tree_view_rebuild();
+
+    if ((idx = _find_file(path)) > 0) {
+        _tree_view_add_dir(idx);
+    }
+
+    /* roots that were taken in stay open where they now are */
+    array_traverse(merged, c_it) {
+        _tree_view_open_path(*c_it);
+        free(*c_it);
+    }
+    array_free(merged);
+
+    if (was_plain && (idx = _find_file(".")) > 0) {
+        f = *(file **)array_item(files, idx);
+        if (!f->open_children) {
+            _tree_view_add_dir(idx);
+        }
+    }
+}
+
+static void _tree_view_remove_root(int n_args, char **args) {
+    char **c_it;
+    char   path[512];
+    int    i;
+
+    if (n_args != 1) {
+        yed_cerr("expected 1 argument, but got %d", n_args);
+        return;
+    }
+
+    _normalize_path(args[0], path);
+
+    i = 0;
+    array_traverse(roots, c_it) {
+        if (strcmp(*c_it, path) == 0) {
+            free(*c_it);
+            array_delete(roots, i);
+            break;
+        }
+        i++;
+    }
+
+    /* back to the plain "." tree */
+    if (array_len(roots) == 1 && strcmp(*(char **)array_item(roots, 0), ".") == 0) {
+        free(*(char **)array_item(roots, 0));
+        array_clear(roots);
+    }
+
+    _set_roots_var();
+    _tree_view_rebuild();
+}
+
+static mount_state *_mount_state(dev_t dev) {
+    mount_state *m;
+    mount_state  new_m;
+
+    array_traverse(mounts, m) {
+        if (m->dev == dev) {
+            return m;
+        }
+    }
+
+    memset(&new_m, 0, sizeof(new_m));
+    new_m.dev = dev;
+    array_push(mounts, new_m);
+
+    return array_last(mounts);
+}
+
+static int _dev_unresponsive(dev_t dev) {
+    mount_state *m;
+
+    array_traverse(mounts, m) {
+        if (m->dev == dev) {
+            return m->unresponsive;
+        }
+    }
+
+    return 0;
+}
+
+static int _is_yes(const char *val) {
+    return val != NULL
+        && (strcmp(val, "yes") == 0 || strcmp(val, "on") == 0 || strcmp(val, "1") == 0);
+}
+
+static int _classify(const char *name, mode_t mode, int broken) {
+    return _classify_with(name, mode, broken, archive_extensions, image_extensions);
+}
+
+/* _classify() against given extension lists, for use off the editor thread. */
+static int _classify_with(const char *name, mode_t mode, int broken,
+                          array_t archive, array_t image) {
+    char **str_it;
+
+    switch (mode & S_IFMT) {
+        case 0:
+            /* lstat failed */
+            return IS_FILE;
+        case S_IFDIR:
+            return IS_DIR;
+        case S_IFLNK:
+            return broken ? IS_B_LINK : IS_LINK;
+        case S_IFBLK:
+        case S_IFCHR:
+            return IS_DEVICE;
+        default:
+            if (mode & S_IXUSR) {
+                return IS_EXEC;
+            }
+
+            array_traverse(archive, str_it) {
+                if (strstr(name, (*str_it))) {
+                    return IS_ARCHIVE;
+                }
+            }
+
+            array_traverse(image, str_it) {
+                if (strstr(name, (*str_it))) {
+                    return IS_IMAGE;
+                }
+            }
+
+            return IS_FILE;
+    }
+}
+
+static void _tree_view_remove_dir(int idx) {
+    file *f;
+
+    f = *(file **)array_item(files, idx);
+
+    _tree_view_delete_rows(idx + 1, _subtree_end(idx));
+
+    f->open_children = 0;
+
+    _tree_view_changed();
+}
+
+static void _tree_view_select(void) {
+    file   *f;
+    meta   *m;
+    dir_id  id;
+    dev_t   dev;
+
+    f = *(file **)array_item(files, ys->active_frame->cursor_line);
+
+    if (f->flags == IS_DIR
+    ||  (f->flags == IS_LINK && (f->open_children || _dir_id_of(f, &id) == 0))) {
+        if (f->open_children) {
+            _set_forced(f->path, 0);
+            _tree_view_remove_dir(ys->active_frame->cursor_line);
+        } else {
+            _tree_view_add_dir(ys->active_frame->cursor_line);
+        }
+    } else if (f->flags == IS_SUMMARY) {
+        _tree_view_load_anyway(ys->active_frame->cursor_line);
+    } else if (f->flags == IS_LINK || f->flags == IS_B_LINK) {
+        /* opening a link into a mount that isn't answering would hang */
+        m   = _meta_find(f->dev, f->ino);
+        dev = (m != NULL && m->target_dev != 0) ? m->target_dev : _link_target_dev(f->path);
+
+        if (dev != 0 && _dev_unresponsive(dev)) {
+            yed_cprint("tree-view: '%s' leads to a mount that isn't answering", f->path);
+            return;
+        }
+
+        YEXE("special-buffer-prepare-jump-focus", f->path);
+        YEXE("buffer", f->path);
+    } else {
+        YEXE("special-buffer-prepare-jump-focus", f->path);
+        YEXE("buffer", f->path);
+    }
+}
+
+static void _tree_view_line_handler(yed_event *event) {
+    file       *f;
+    meta       *m;
+    yed_attrs  *attr_tmp;
+    char       *color_var;
+    yed_attrs   attr_dir;
+    yed_attrs   attr_exec;
+    yed_attrs   attr_symb_link;
+    yed_attrs   attr_device;
+    yed_attrs   attr_graphic_img;
+    yed_attrs   attr_archive;
+    yed_attrs   attr_broken_link;
+    yed_attrs   attr_file;
+    yed_attrs   attr_match;
+    yed_attrs   attr_unresponsive;
+    int         match;
+    int         loc;
+    int         base;
+    yed_line   *line;
+    unsigned long long start;
+
+    if (event->frame         == NULL
+    ||  event->frame->buffer == NULL
+    ||  event->frame->buffer != _get_or_make_buff()) {
+        return;
+    }
+
+    if (array_len(files) <= event->row) { return; }
+
+    start = _now_us();
+
+    f = *(file **) array_item(files, event->row);
+
+    if (f->path == NULL) { return; }
+
+    attr_dir         = ZERO_ATTR;
+    attr_exec        = ZERO_ATTR;
+    attr_symb_link   = ZERO_ATTR;
+    attr_device      = ZERO_ATTR;
+    attr_graphic_img = ZERO_ATTR;
+    attr_archive     = ZERO_ATTR;
+    attr_broken_link = ZERO_ATTR;
+    attr_file        = ZERO_ATTR;
+
+    if ((color_var = yed_get_var("tree-view-directory-color"))) {
+        attr_dir         = yed_parse_attrs(color_var);
+    }
+
+    if ((color_var = yed_get_var("tree-view-exec-color"))) {
+        attr_exec         = yed_parse_attrs(color_var);
+    }
+
+    if ((color_var = yed_get_var("tree-view-symbolic-link-color"))) {
+        attr_symb_link         = yed_parse_attrs(color_var);
+    }
+
+    if ((color_var = yed_get_var("tree-view-device-color"))) {
+        attr_device         = yed_parse_attrs(color_var);
+    }
+
+    if ((color_var = yed_get_var("tree-view-graphic-image-color"))) {
+        attr_graphic_img         = yed_parse_attrs(color_var);
+    }
+
+    if ((color_var = yed_get_var("tree-view-archive-color"))) {
+        attr_archive         = yed_parse_attrs(color_var);
+    }
+
+    if ((color_var = yed_get_var("tree-view-broken-link-color"))) {
+        attr_broken_link         = yed_parse_attrs(color_var);
+    }
+
+    attr_unresponsive = ZERO_ATTR;
+    if ((color_var = yed_get_var("tree-view-unresponsive-color"))) {
+        attr_unresponsive        = yed_parse_attrs(color_var);
+    }
+
+    attr_match = ZERO_ATTR;
+    match      = _grep_count(f->path) > 0;
+    if (match && (color_var = yed_get_var("tree-view-grep-match-color"))) {
+        attr_match               = yed_parse_attrs(color_var);
+    }
+
+    base = 0;
+    switch (f->flags) {
+        case IS_DIR:
+            attr_tmp = &attr_dir;
+            break;
+        case IS_LINK:
+            attr_tmp = &attr_symb_link;
+            break;
+        case IS_B_LINK:
+            attr_tmp = &attr_broken_link;
+            break;
+        case IS_DEVICE:
+            attr_tmp = &attr_device;
+            break;
+        case IS_ARCHIVE:
+            attr_tmp = &attr_archive;
+            break;
+        case IS_IMAGE:
+            attr_tmp = &attr_graphic_img;
+            break;
+        case IS_EXEC:
+            attr_tmp = &attr_exec;
+            break;
+        case IS_FILE:
+        default:
+            base = 1;
+            attr_tmp = &attr_file;
+            break;
+    }
+
+    if (_dev_unresponsive(f->dev)
+    ||  ((f->flags == IS_LINK || f->flags == IS_B_LINK)
+         && (m = _meta_find(f->dev, f->ino)) != NULL
+         && m->target_dev != 0
+         && _dev_unresponsive(m->target_dev))) {
+        base     = 0;
+        attr_tmp = &attr_unresponsive;
+    }
+
+    if (event->frame->buffer == NULL) { return; }
+
+    line = yed_buff_get_line(event->frame->buffer, event->row);
+    if (line == NULL) { return; }
+
+    for (loc = 1; loc <= line->visual_width; loc += 1) {
+        if (loc > f->color_loc) {
+            if (!base) {
+                yed_eline_combine_col_attrs(event, loc, attr_tmp);
+            }
+            if (match) {
+                yed_eline_combine_col_attrs(event, loc, &attr_match);
+            }
+        }
+    }
+
+    _budget_check("draw", start, 1, "row");
+}
+
+static void _tree_view_key_pressed_handler(yed_event *event) {
+    yed_frame          *eframe;
+    unsigned long long  start;
+
+    eframe = ys->active_frame;
+
+    if (event->key != ENTER
+    ||  ys->interactive_command
+    ||  !eframe
+    ||  !eframe->buffer
+    ||  strcmp(eframe->buffer->name, "*tree-view-list")) {
+        return;
+    }
+
+    start = _now_us();
+    _tree_view_select();
+    _budget_check("select", start, 1, "row");
+
+    event->cancel = 1;
+}
+
+static void  _tree_view_update_handler(yed_event *event) {
+    time_t              curr_time;
+    unsigned long long  start;
+
+    start = _now_us();
+
+    _grep_drain();
+    _export_drain();
+    _notify_subscribers();
+    _preview_update();
+
+    _budget_check("update", start, array_len(files), "rows");
+
+    curr_time = time(NULL);
+
+    if (curr_time > last_time + refresh_period) {
+        /* a refresh that is still going counts as this one */
+        if (_task_find(TASK_REFRESH) == NULL) {
+            _tree_view_refresh();
+        }
+        last_time = curr_time;
+    }
+
+    _tasks_run(start);
+}
+
+/*
+ * Applies a changed tree-view-* variable to the tree that is already
+ * loaded: only the rows it affects are touched, and nothing is reread
+ * unless the change can reveal entries that were never scanned.
+ */
+static void _tree_view_var_handler(yed_event *event) {
+    const char  *name;
+    const char  *val;
+    char       **c_it;
+
+    name = event->var_name;
+
+    if (name == NULL
+    ||  strncmp(name, "tree-view-", strlen("tree-view-")) != 0
+    ||  array_len(files) == 0) {
+        return;
+    }
+
+    val = yed_get_var(name);
+
+    if (strcmp(name, "tree-view-update-period") == 0) {
+        wait_time      = val ? atoi(val) : 5;
+        refresh_period = wait_time;
+    } else if (strcmp(name, "tree-view-hidden-items") == 0) {
+        _add_hidden_items();
+
+        /* a refresh already under way was reading with the old list */
+        _task_cancel(TASK_REFRESH);
+        _tree_view_refresh();
+    } else if (strcmp(name, "tree-view-archive-extensions") == 0) {
+        _add_archive_extensions();
+        _task_queue(TASK_RECLASSIFY)->pos = 0;
+    } else if (strcmp(name, "tree-view-image-extensions") == 0) {
+        _add_image_extensions();
+        _task_queue(TASK_RECLASSIFY)->pos = 0;
+    } else if (strncmp(name, "tree-view-child-char-", strlen("tree-view-child-char-")) == 0) {
+        _tree_view_redraw_rows();
+    } else if (strcmp(name, "tree-view-stat-backend") == 0
+           ||  strcmp(name, "tree-view-uring-depth")  == 0) {
+#ifdef TREE_VIEW_URING
+        /* give io_uring_setup() another go */
+        uring_unavailable = 0;
+#endif
+    } else if (strcmp(name, "tree-view-roots") == 0 && !setting_roots) {
+        array_traverse(roots, c_it) {
+            free(*c_it);
+        }
+        array_clear(roots);
+
+        _add_roots();
+        _tree_view_rebuild();
+    }
+}
+
+/* Rebuild the tree from disk in one go, keeping the same directories open.
+ * Used when the set of roots changes.  Each unique directory is read at
+ * most once however many rows show it. */
+static void _tree_view_rebuild(void) {
+    file    **f;
+    char     *path;
+    char    **c_it;
+    array_t   open_dirs;
+    int       idx;
+
+    open_dirs = array_make(char *);
+
+    idx = 0;
+    array_traverse(files, f) {
+        if (idx == 0) { idx++; continue; }
+
+        if ((*f)->open_children) {
+            path = strdup((*f)->path);
+            array_push(open_dirs, path);
+        }
+
+        idx++;
+    }
+
+    _listings_clear();
+    _metas_invalidate();
+    _tree_view_init();
+
+    /* parents come before their children, so each one is loaded in time */
+    array_traverse(open_dirs, c_it) {
+        if ((idx = _find_file(*c_it)) > 0) {
+            _tree_view_add_dir(idx);
+        }
+        free(*c_it);
+    }
+
+    array_free(open_dirs);
+}
+
+/*
+ * Queues an update of every open directory against the disk.  The
+ * directories are reconciled one per step, last row first, so rows above
+ * the one being worked on never move while the refresh is spread over
+ * several pumps.
+ */
+static void _tree_view_refresh(void) {
+    file **f_it;
+    task  *t;
+    char  *path;
+
+    t = _task_queue(TASK_REFRESH);
+
+    array_traverse(files, f_it) {
+        if ((*f_it)->open_children
+        &&  ((*f_it)->flags == IS_DIR || (*f_it)->flags == IS_LINK)) {
+            path = strdup((*f_it)->path);
+            array_push(t->paths, path);
+        }
+    }
+
+    _listings_clear();
+    _metas_invalidate();
+}
+
+static void _tree_view_expand_recursive(int n_args, char **args) {
+    file *f;
+    task *t;
+    char  path[512];
+    int   idx;
+
+    if (n_args > 1) {
+        yed_cerr("expected 0 or 1 arguments, but got %d", n_args);
+        return;
+    }
+
+    if (n_args == 1) {
+        _normalize_path(args[0], path);
+        idx = _find_file(path);
+    } else if (ys->active_frame
+           &&  ys->active_frame->buffer == _get_or_make_buff()) {
+        idx = ys->active_frame->cursor_line;
+    } else {
+        idx = 0;
+    }
+
+    if (idx < 0 || idx >= array_len(files)
+    ||  (f = *(file **)array_item(files, idx))->flags != IS_DIR) {
+        yed_cerr("tree-view: not a directory in the tree");
+        return;
+    }
+
+    t = _task_queue(TASK_EXPAND);
+    memset(t->root, 0, sizeof(t->root));
+    memset(t->last, 0, sizeof(t->last));
+    strncat(t->root, f->path, sizeof(t->root) - 1);
+}
+
+static int _budget_ms(void) {
+    char *val;
+
+    val = yed_get_var("tree-view-max-handler-ms");
+
+    return val ? atoi(val) : 0;
+}
+
+/* Logs a handler (or task slice) that ran past tree-view-max-handler-ms. */
+static void _budget_check(const char *phase, unsigned long long start_us,
+                          int entries, const char *unit) {
+    unsigned long long elapsed;
+    int                budget;
+
+    if ((budget = _budget_ms()) <= 0) { return; }
+
+    elapsed = _now_us() - start_us;
+    if (elapsed <= (unsigned long long)budget * 1000ULL) { return; }
+
+    yed_log("\ntree-view: %s took %llu.%03llums of a %dms budget (%d %s)",
+            phase, elapsed / 1000ULL, elapsed % 1000ULL, budget, entries, unit);
+}
+
+static task *_task_find(int kind) {
+    task **t_it;
+
+    array_traverse(tasks, t_it) {
+        if ((*t_it)->kind == kind) { return *t_it; }
+    }
+
+    return NULL;
+}
+
+static int _count_children(int idx) {
+    file *f;
+    int   row;
+    int   n;
+
+    f = *(file **)array_item(files, idx);
+
+    n = 0;
+    for (row = idx + 1; row < array_len(files); row = _subtree_end(row)) {
+        if ((*(file **)array_item(files, row))->num_tabs <= f->num_tabs) { break; }
+        n += 1;
+    }
+
+    return n;
+}
+
+/* Returns the queued task of this kind, adding one if there is none. */
+static task *_task_queue(int kind) {
+    task *t;
+
+    if ((t = _task_find(kind))) { return t; }
+
+    t        = calloc(1, sizeof(task));
+    t->kind  = kind;
+    t->paths = array_make(char *);
+    array_push(tasks, t);
+
+    return t;
+}
+
+static void _task_cancel(int kind) {
+    int i;
+
+    for (i = 0; i < array_len(tasks); i++) {
+        if ((*(task **)array_item(tasks, i))->kind == kind) {
+            _task_free(*(task **)array_item(tasks, i));
+            array_delete(tasks, i);
+            return;
+        }
+    }
+}
+
+static void _task_free(task *t) {
+    char **c_it;
+
+    array_traverse(t->paths, c_it) {
+        free(*c_it);
+    }
+    array_free(t->paths);
+    free(t);
+}
+
+/* One step of t.  Returns non-zero once the task is done. */
+static int _task_step(task *t) {
+    file        *f;
+    file        *root;
+    grep_result *r;
+    char       **path;
+    int          idx;
+    int          end;
+
+    switch (t->kind) {
+        case TASK_REFRESH:
+            if (array_len(t->paths) == 0) { return 1; }
+
+            path = array_last(t->paths);
+            if ((idx = _find_file(*path)) >= 0) {
+                _tree_view_reconcile_dir(idx);
+                t->entries += _count_children(idx);
+            }
+            free(*path);
+            array_delete(t->paths, array_len(t->paths) - 1);
+
+            return array_len(t->paths) == 0;
+
+        case TASK_EXPAND:
+            if ((idx = _find_file(t->root)) < 0) { return 1; }
+            root = *(file **)array_item(files, idx);
+
+            if (t->last[0]) {
+                if ((idx = _find_file(t->last)) < 0) { return 1; }
+                idx += 1;
+            }
+
+            /* next collapsed directory inside the subtree */
+            for (; idx < array_len(files); idx++) {
+                f = *(file **)array_item(files, idx);
+                if (f != root && f->num_tabs <= root->num_tabs) { return 1; }
+                if (f->flags == IS_DIR && !f->open_children)    { break;    }
+            }
+            if (idx >= array_len(files)) { return 1; }
+
+            memset(t->last, 0, sizeof(t->last));
+            strncat(t->last, f->path, sizeof(t->last) - 1);
+
+            _tree_view_add_dir(idx);
+
+            t->entries += _count_children(idx);
+
+            return 0;
+
+        case TASK_RECLASSIFY:
+            end = t->pos + RECLASSIFY_SLICE;
+            if (end > array_len(files)) { end = array_len(files); }
+
+            if (_tree_view_reclassify(t->pos, end)) {
+                ys->redraw = 1;
+            }
+
+            t->entries += end - t->pos;
+            t->pos      = end;
+
+            return t->pos >= array_len(files);
+
+        case TASK_GREP:
+            if (t->pos < array_len(grep_pending)) {
+                r = array_item(grep_pending, t->pos);
+                _grep_reveal(r->path, r->count);
+
+                t->entries += 1;
+                t->pos     += 1;
+            }
+
+            if (t->pos < array_len(grep_pending)) { return 0; }
+
+            /* caught up; _grep_drain() queues a new task for more */
+            array_traverse(grep_pending, r) {
+                free(r->path);
+            }
+            array_clear(grep_pending);
+
+            return 1;
+    }
+
+    return 1;
+}
+
+static void _task_done(task *t) {
+    if (t->kind != TASK_REFRESH) { return; }
+
+    /* a tree too big to refresh within one pump's budget gets refreshed
+     * less often, until it fits again */
+    if (t->pumps > 1) {
+        refresh_period = refresh_period ? refresh_period * 2 : 1;
+        if (refresh_period > 300) { refresh_period = 300; }
+
+        yed_log("\ntree-view: refresh of %d entries took %d pumps; refreshing every %ds",
+                t->entries, t->pumps, (int)refresh_period);
+    } else {
+        refresh_period = wait_time;
+    }
+}
+
+/*
+ * Runs queued tasks until this pump's share of tree-view-max-handler-ms is
+ * used up.  At least one step runs per pump so that work always moves; a
+ * single step that is longer than the whole budget is logged, since that
+ * is lag no amount of slicing hides.
+ */
+static void _tasks_run(unsigned long long start_us) {
+    task               *t;
+    unsigned long long  budget_us;
+    unsigned long long  step_start;
+    int                 entries;
+    int                 done;
+
+    budget_us = (unsigned long long)_budget_ms() * 1000ULL;
+
+    while (array_len(tasks) > 0) {
+        t         = *(task **)array_item(tasks, 0);
+        t->pumps += 1;
+
+        do {
+            step_start = _now_us();
+            entries    = t->entries;
+            done       = _task_step(t);
+
+            _budget_check(task_phases[t->kind], step_start, t->entries - entries, "entries");
+        } while (!done && !(budget_us && _now_us() - start_us >= budget_us));
+
+        if (!done) { break; }
+
+        _task_done(t);
+        _task_free(t);
+        array_delete(tasks, 0);
+
+        if (budget_us && _now_us() - start_us >= budget_us) { break; }
+    }
+}
+
+static yed_buffer *_get_or_make_buff(void) {
+    yed_buffer *buff;
+
+    buff = yed_get_buffer("*tree-view-list");
+
+    if (buff == NULL) {
+        buff = yed_create_buffer("*tree-view-list");
+        buff->flags |= BUFF_RD_ONLY | BUFF_SPECIAL;
+    }
+
+    return buff;
+}
+
+static file *_init_file(int parent_idx, char *path, char *name, int if_dir, int num_tabs, int color_loc) {
+    file *f;
+
+    f = malloc(sizeof(file));
+    memset(f, 0, sizeof(file));
+
+    if (parent_idx == IS_ROOT) {
+        f->parent = NULL;
+    } else {
+        f->parent  = *(struct file **) array_item(files, parent_idx);
+        f->top_dev = (*(file **) array_item(files, parent_idx))->top_dev;
+    }
+
+    memset(f->path, 0, sizeof(char[512]));
+    strncat(f->path, path, sizeof(f->path) - 1);
+
+    memset(f->name, 0, sizeof(char[512]));
+    strncat(f->name, name, sizeof(f->name) - 1);
+
+    f->flags         = if_dir;
+    f->num_tabs      = num_tabs;
+    f->open_children = 0;
+    f->color_loc     = color_loc;
+
+    return f;
+}
+
+static void _clear_files(void) {
+    file **file_it;
+
+    array_traverse(files, file_it) {
+        free(*file_it);
+    }
+
+    array_clear(files);
+}
+
+/* The variable's value, or dflt once it has been unset. */
+static const char *_child_char(const char *var, const char *dflt) {
+    const char *val;
+
+    val = yed_get_var(var);
+
+    return val ? val : dflt;
+}
+
+static int _tree_view_row_text(file *f, int last, char *out) {
+    meta *m;
+    int   color_loc;
+    int   count;
+    int   i;
+    int   j;
+    char  suffix[32];
+
+    color_loc = f->num_tabs * yed_get_tab_width();
+    memset(out, 0, sizeof(char[1024]));
+
+    if (f->num_tabs > 0) {
+        color_loc += 1;
+
+        for (i = 0; i < f->num_tabs; i++) {
+            strcat(out, _child_char("tree-view-child-char-i", "│"));
+            for (j = 0; j < yed_get_tab_width()-1; j++) {
+                strcat(out, " ");
+            }
+        }
+
+        if (last) {
+            strcat(out, _child_char("tree-view-child-char-l", "└"));
+        } else {
+            strcat(out, _child_char("tree-view-child-char-t", "├"));
+        }
+    }
+
+    strncat(out, f->name, 1024 - strlen(out) - sizeof(suffix));
+
+    if ((f->flags == IS_LINK || f->flags == IS_B_LINK)
+    &&  (m = _meta_find(f->dev, f->ino)) != NULL
+    &&  m->link != NULL) {
+        strncat(out, " -> ", 1024 - strlen(out) - sizeof(suffix));
+        strncat(out, m->link, 1024 - strlen(out) - sizeof(suffix));
+    }
+
+    if ((count = _grep_count(f->path)) > 0) {
+        snprintf(suffix, sizeof(suffix), " (%d)", count);
+        strcat(out, suffix);
+    }
+
+    return color_loc;
+}
+
+static int _tree_view_is_last(int idx) {
+    file *f;
+    file *next;
+
+    f = *(file **)array_item(files, idx);
+
+    for (idx += 1; idx < array_len(files); idx++) {
+        next = *(file **)array_item(files, idx);
+        if (next->num_tabs <  f->num_tabs) { return 1; }
+        if (next->num_tabs == f->num_tabs) { return 0; }
+    }
+
+    return 1;
+}
+
+static void _tree_view_redraw_row(int idx) {
+    yed_buffer *buff;
+    file       *f;
+    char        write_name[1024];
+
+    if (idx <= 0 || idx >= array_len(files)) { return; }
+
+    f    = *(file **)array_item(files, idx);
+    buff = _get_or_make_buff();
+
+    buff->flags &= ~BUFF_RD_ONLY;
+
+    f->color_loc = _tree_view_row_text(f, _tree_view_is_last(idx), write_name);
+    yed_buff_insert_line_no_undo(buff, idx);
+    yed_buff_insert_string_no_undo(buff, write_name, idx, 1);
+    yed_buff_delete_line(buff, idx + 1);
+
+    buff->flags |= BUFF_RD_ONLY;
+}
+
+static void _tree_view_redraw_rows(void) {
+    int idx;
+
+    for (idx = 1; idx < array_len(files); idx++) {
+        _tree_view_redraw_row(idx);
+    }
+}
+
+/* First row past the subtree rooted at idx. */
+static int _subtree_end(int idx) {
+    file *f;
+    int   end;
+
+    f = *(file **)array_item(files, idx);
+
+    for (end = idx + 1; end < array_len(files); end++) {
+        if ((*(file **)array_item(files, end))->num_tabs <= f->num_tabs) { break; }
+    }
+
+    return end;
+}
+
+/* Puts f at row idx.  Its glyph is drawn as a last child; callers that
+ * change a sibling list redraw it afterwards. */
+static void _tree_view_insert_row(int idx, file *f) {
+    yed_buffer *buff;
+    char        write_name[1024];
+
+    buff = _get_or_make_buff();
+    buff->flags &= ~BUFF_RD_ONLY;
+
+    /* an empty tree is still one blank line */
+    if (array_len(files) > 1) {
+        yed_buff_insert_line_no_undo(buff, idx);
+    }
+
+    f->color_loc = _tree_view_row_text(f, 1, write_name);
+    yed_buff_insert_string_no_undo(buff, write_name, idx, 1);
+
+    if (idx >= array_len(files)) {
+        array_push(files, f);
+    } else {
+        array_insert(files, idx, f);
+    }
+
+    buff->flags |= BUFF_RD_ONLY;
+}
+
+/* Drops rows start through end - 1 and frees their nodes. */
+static void _tree_view_delete_rows(int start, int end) {
+    yed_buffer *buff;
+    int         row;
+
+    if (start >= end) { return; }
+
+    buff = _get_or_make_buff();
+    buff->flags &= ~BUFF_RD_ONLY;
+
+    for (row = end - 1; row >= start; row--) {
+        free(*(file **)array_item(files, row));
+        array_delete(files, row);
+
+        if (array_len(files) > 1) {
+            yed_buff_delete_line(buff, row);
+        } else {
+            yed_buff_clear_no_undo(buff);
+        }
+    }
+
+    buff->flags |= BUFF_RD_ONLY;
+}
+
+/*
+ * Brings the rows under the open directory at idx in line with its current
+ * listing.  Entries that went away (or are now hidden) lose their rows and
+ * subtrees, new ones are inserted in sort order, and rows that stay keep
+ * their expansion.  Only rows after idx move.  Returns how many rows were
+ * added or removed.
+ */
+static int _tree_view_reconcile_dir(int idx) {
+    file       *f;
+    file       *child;
+    file       *cand;
+    listing    *cached;
+    dir_entry  *e_it;
+    array_t     entries;
+    array_t     cands;
+    dir_count   count;
+    int         limit;
+    int         status;
+    int         row;
+    int         c;
+    int         cmp;
+    int         changed;
+    int         touched;
+    char        path[1024];
+    dir_id      id;
+
+    f = *(file **)array_item(files, idx);
+
+    if (!f->open_children || _dir_id_of(f, &id) != 0) { return 0; }
+
+    /* a summary only needs its counts (or the limits) looked at again */
+    if (idx + 1 < array_len(files)
+    &&  (*(file **)array_item(files, idx + 1))->flags == IS_SUMMARY) {
+        _tree_view_remove_dir(idx);
+        _tree_view_add_dir(idx);
+        return 1;
+    }
+
+    limit = _dir_limit(f, _subtree_end(idx) - idx - 1);
+
+    cached = _listing_current(f, &id);
+    if (cached) {
+        if (limit >= 0 && cached->count.entries > limit) {
+            _tree_view_remove_dir(idx);
+            _tree_view_add_summary(idx, &cached->count);
+            return 1;
+        }
+        entries = cached->entries;
+    } else {
+        if (id.dev != f->top_dev) {
+            status = _scan_dir_with_timeout(f, id.dev, limit, &entries, &count);
+        } else {
+            status = _scan_dir(f->path, hidden_items, limit, _uring_depth(), &entries, &count);
+        }
+
+        if (status < 0) { return 0; }
+
+        if (status > 0) {
+            /* grew past the limits since it was opened */
+            _tree_view_remove_dir(idx);
+            _tree_view_add_summary(idx, &count);
+            return 1;
+        }
+
+        cached = _listing_store(&id, entries);
+    }
+
+    cands = array_make(file *);
+    array_traverse(entries, e_it) {
+        if (_is_hidden(hidden_items, e_it->name)) { continue; }
+
+        snprintf(path, sizeof(path), "%s/%s", f->path, e_it->name);
+
+        cand = _init_file(idx, path, e_it->name,
+                          _classify(e_it->name, e_it->st.st_mode, e_it->broken),
+                          f->num_tabs + 1, 0);
+        cand->mode  = e_it->st.st_mode;
+        cand->size  = e_it->st.st_size;
+        cand->mtime = e_it->st.st_mtime;
+        cand->dev   = e_it->st.st_dev;
+        cand->ino   = e_it->st.st_ino;
+
+        array_push(cands, cand);
+    }
+
+    if (cached == NULL) {
+        array_free(entries);
+    }
+
+    qsort(array_data(cands), array_len(cands), sizeof(file *), _cmpfunc);
+
+    /* both sides are in _cmpfunc order, so one merge pass does it */
+    changed = 0;
+    touched = 0;
+    row     = idx + 1;
+    c       = 0;
+    for (;;) {
+        child = NULL;
+        if (row < array_len(files)) {
+            child = *(file **)array_item(files, row);
+            if (child->num_tabs <= f->num_tabs) { child = NULL; }
+        }
+
+        cand = NULL;
+        if (c < array_len(cands)) {
+            cand = *(file **)array_item(cands, c);
+        }
+
+        if (child == NULL && cand == NULL) { break; }
+
+        if (child == NULL) {
+            cmp = -1;
+        } else if (cand == NULL) {
+            cmp = 1;
+        } else {
+            cmp = _cmpfunc(&cand, &child);
+        }
+
+        if (cmp == 0) {
+            if (child->flags != cand->flags
+            ||  child->mode  != cand->mode
+            ||  child->size  != cand->size
+            ||  child->mtime != cand->mtime
+            ||  child->dev   != cand->dev
+            ||  child->ino   != cand->ino) {
+                touched = 1;
+            }
+
+            child->flags = cand->flags;
+            child->mode  = cand->mode;
+            child->size  = cand->size;
+            child->mtime = cand->mtime;
+            child->dev   = cand->dev;
+            child->ino   = cand->ino;
+            free(cand);
+
+            row = _subtree_end(row);
+            c  += 1;
+        } else if (cmp < 0) {
+            _tree_view_insert_row(row, cand);
+
+            row     += 1;
+            c       += 1;
+            changed += 1;
+        } else {
+            _tree_view_delete_rows(row, _subtree_end(row));
+
+            changed += 1;
+        }
+    }
+
+    array_free(cands);
+
+    if (changed) {
+        for (row = idx + 1; row < array_len(files); row = _subtree_end(row)) {
+            if ((*(file **)array_item(files, row))->num_tabs <= f->num_tabs) { break; }
+            _tree_view_redraw_row(row);
+        }
+    }
+
+    /* a kind, size or mtime change is news to subscribers and the preview */
+    if (changed || touched) {
+        _tree_view_changed();
+    }
+
+    return changed;
+}
+
+/* Re-runs _classify() over the regular files in rows start through
+ * end - 1.  Returns how many changed kind. */
+static int _tree_view_reclassify(int start, int end) {
+    file *f;
+    int   idx;
+    int   kind;
+    int   changed;
+
+    changed = 0;
+    for (idx = start; idx < end; idx++) {
+        f = *(file **)array_item(files, idx);
+        if (!S_ISREG(f->mode)) { continue; }
+
+        kind = _classify(f->name, f->mode, 0);
+        if (kind != f->flags) {
+            f->flags  = kind;
+            changed  += 1;
+        }
+    }
+
+    if (changed) {
+        _tree_view_changed();
+    }
+
+    return changed;
+}
+
+static int _cmpfunc(const void *a, const void *b) {
+    file *left_f;
+    file *right_f;
+    char  left_name[512];
+    char  right_name[512];
+    int   left;
+    int   right;
+    int   loc;
+
+    left_f  = *(file **)a;
+    right_f = *(file **)b;
+
+    left = 0;
+    if (left_f->flags == IS_DIR) {
+        left = 1;
+    }
+
+    right = 0;
+    if (right_f->flags == IS_DIR) {
+        right = 1;
+    }
+
+    if (left < right) {
+        return  1;
+    } else if (left > right) {
+        return -1;
+    } else {
+        strcpy(left_name, left_f->name);
+        strcpy(right_name, right_f->name);
+
+        loc = 0;
+        while (left_name[loc]) {
+            left_name[loc] = tolower(left_name[loc]);
+            loc++;
+        }
+
+        loc = 0;
+        while (right_name[loc]) {
+            right_name[loc] = tolower(right_name[loc]);
+            loc++;
+        }
+
+        loc = strcmp(left_name, right_name);
+
+        /* names differing only in case still need a stable order */
+        return loc ? loc : strcmp(left_f->name, right_f->name);
+    }
+
+    return ((file *)a)->flags - ((file *)b)->flags;
+}
+
+static void _tree_view_changed(void) {
+    generation += 1;
+}
+
+static void _notify_subscribers(void) {
+    subscriber *sub;
+    int         n;
+    int         i;
+
+    if (notified_generation == generation) { return; }
+
+    notified_generation = generation;
+
+    /* A callback may subscribe and grow (move) the array, so index it
+     * afresh each time.  Ones added here hear about the next change. */
+    n = array_len(subscribers);
+    for (i = 0; i < n; i++) {
+        sub = array_item(subscribers, i);
+        if (sub->fn) {
+            sub->fn(generation, sub->arg);
+        }
+    }
+}
+
+static unsigned long _hash_path(const char *path) {
+    unsigned long h;
+
+    h = 5381;
+    while (*path) {
+        h = ((h << 5) + h) + (unsigned char)*path;
+        path++;
+    }
+
+    return h;
+}
+
+static void _build_path_index(void) {
+    file **f_it;
+    int    cap;
+    int    idx;
+    int    slot;
+
+    cap = 64;
+    while (cap < array_len(files) * 2) {
+        cap <<= 1;
+    }
+
+    if (cap != path_index_cap) {
+        free(path_index);
+        path_index     = malloc(sizeof(int) * cap);
+        path_index_cap = cap;
+    }
+    memset(path_index, 0, sizeof(int) * cap);
+
+    /* slots hold idx + 1 so that 0 marks an empty slot */
+    idx = 0;
+    array_traverse(files, f_it) {
+        slot = _hash_path((*f_it)->path) & (cap - 1);
+        while (path_index[slot]) {
+            slot = (slot + 1) & (cap - 1);
+        }
+        path_index[slot] = idx + 1;
+        idx++;
+    }
+
+    index_generation = generation;
+}
+
+static int _find_file(const char *path) {
+    file *f;
+    int   slot;
+
+    if (array_len(files) == 0) { return -1; }
+
+    if (path_index == NULL || index_generation != generation) {
+        _build_path_index();
+    }
+
+    slot = _hash_path(path) & (path_index_cap - 1);
+    while (path_index[slot]) {
+        f = *(file **)array_item(files, path_index[slot] - 1);
+        if (strcmp(f->path, path) == 0) {
+            return path_index[slot] - 1;
+        }
+        slot = (slot + 1) & (path_index_cap - 1);
+    }
+
+    return -1;
+}
+
+static void _normalize_path(const char *in, char *out) {
+    int len;
+
+    memset(out, 0, sizeof(char[512]));
+
+    if (strcmp(in, ".") == 0 || strcmp(in, "./") == 0 || *in == 0) {
+        strcat(out, ".");
+        return;
+    }
+
+    if (*in != '/'
+    &&  strncmp(in, "./", 2)  != 0
+    &&  strncmp(in, "../", 3) != 0
+    &&  strcmp(in, "..")      != 0) {
+        strcat(out, "./");
+    }
+    strncat(out, in, 512 - strlen(out) - 1);
+
+    len = strlen(out);
+    while (len > 1 && out[len - 1] == '/') {
+        out[--len] = 0;
+    }
+}
+
+static void _fill_node(file *f, tree_view_node *out) {
+    out->path     = f->path;
+    out->name     = f->name;
+    out->kind     = f->flags;
+    out->depth    = f->num_tabs;
+    out->expanded = f->open_children;
+    out->mode     = f->mode;
+    out->size     = f->size;
+    out->mtime    = f->mtime;
+}
+
+static unsigned long long _api_generation(void) {
+    return generation;
+}
+
+static int _api_lookup(const char *path, tree_view_node *out) {
+    char norm[512];
+    int  idx;
+
+    _normalize_path(path, norm);
+
+    if ((idx = _find_file(norm)) < 0) { return -1; }
+
+    _fill_node(*(file **)array_item(files, idx), out);
+
+    return 0;
+}
+
+static int _api_children(const char *path, tree_view_visit_fn fn, void *arg) {
+    file           *f;
+    file           *child;
+    tree_view_node  node;
+    char            norm[512];
+    int             idx;
+    int             n;
+
+    _normalize_path(path, norm);
+
+    if ((idx = _find_file(norm)) < 0) { return -1; }
+
+    f = *(file **)array_item(files, idx);
+    if (!f->open_children) { return -1; }
+
+    n = 0;
+    for (idx += 1; idx < array_len(files); idx++) {
+        child = *(file **)array_item(files, idx);
+        if (child->num_tabs <= f->num_tabs) { break; }
+        if (child->num_tabs != f->num_tabs + 1) { continue; }
+
+        _fill_node(child, &node);
+        n++;
+        if (fn(&node, arg)) { break; }
+    }
+
+    return n;
+}
+
+static int _api_prefix(const char *prefix, tree_view_visit_fn fn, void *arg) {
+    file           **f_it;
+    tree_view_node   node;
+    char             norm[512];
+    int              len;
+    int              n;
+
+    _normalize_path(prefix, norm);
+    len = strlen(norm);
+
+    /* whole components only: "./lib" is not a prefix of "./library" */
+    n = 0;
+    array_traverse(files, f_it) {
+        if (strncmp((*f_it)->path, norm, len) != 0) { continue; }
+        if ((*f_it)->path[len] != 0
+        &&  (*f_it)->path[len] != '/'
+        &&  norm[len - 1]      != '/') {
+            continue;
+        }
+
+        _fill_node(*f_it, &node);
+        n++;
+        if (fn(&node, arg)) { break; }
+    }
+
+    return n;
+}
+
+static int _api_glob(const char *pattern, tree_view_visit_fn fn, void *arg) {
+    file           **f_it;
+    tree_view_node   node;
+    int              n;
+
+    n = 0;
+    array_traverse(files, f_it) {
+        if (fnmatch(pattern, (*f_it)->path, 0) != 0) { continue; }
+
+        _fill_node(*f_it, &node);
+        n++;
+        if (fn(&node, arg)) { break; }
+    }
+
+    return n;
+}
+
+static int _api_subscribe(tree_view_change_fn fn, void *arg) {
+    subscriber *sub;
+    subscriber  new_sub;
+    int         handle;
+
+    if (fn == NULL) { return -1; }
+
+    handle = 0;
+    array_traverse(subscribers, sub) {
+        if (sub->fn == NULL) {
+            sub->fn  = fn;
+            sub->arg = arg;
+            return handle;
+        }
+        handle++;
+    }
+
+    new_sub.fn  = fn;
+    new_sub.arg = arg;
+    array_push(subscribers, new_sub);
+
+    return handle;
+}
+
+static void _api_unsubscribe(int handle) {
+    subscriber *sub;
+
+    if (handle < 0 || handle >= array_len(subscribers)) { return; }
+
+    sub      = array_item(subscribers, handle);
+    sub->fn  = NULL;
+    sub->arg = NULL;
+}
+
+const tree_view_api *tree_view_get_api(void) {
+    static const tree_view_api api = {
+        TREE_VIEW_API_VERSION,
+        _api_generation,
+        _api_lookup,
+        _api_children,
+        _api_prefix,
+        _api_glob,
+        _api_subscribe,
+        _api_unsubscribe,
+    };
+
+    return &api;
+}
+
+static int _grep_count(const char *path) {
+    int slot;
+
+    if (grep_counts_cap == 0) { return 0; }
+
+    slot = _hash_path(path) & (grep_counts_cap - 1);
+    while (grep_counts[slot].path) {
+        if (strcmp(grep_counts[slot].path, path) == 0) {
+            return grep_counts[slot].count;
+        }
+        slot = (slot + 1) & (grep_counts_cap - 1);
+    }
+
+    return 0;
+}
+
+static void _grep_count_add(const char *path, int count) {
+    grep_result *old;
+    int          old_cap;
+    int          slot;
+    int          i;
+
+    if ((grep_counts_len + 1) * 2 > grep_counts_cap) {
+        old     = grep_counts;
+        old_cap = grep_counts_cap;
+
+        grep_counts_cap = old_cap ? old_cap * 2 : 64;
+        grep_counts     = calloc(grep_counts_cap, sizeof(grep_result));
+
+        for (i = 0; i < old_cap; i++) {
+            if (old[i].path == NULL) { continue; }
+            slot = _hash_path(old[i].path) & (grep_counts_cap - 1);
+            while (grep_counts[slot].path) {
+                slot = (slot + 1) & (grep_counts_cap - 1);
+            }
+            grep_counts[slot] = old[i];
+        }
+        free(old);
+    }
+
+    slot = _hash_path(path) & (grep_counts_cap - 1);
+    while (grep_counts[slot].path) {
+        if (strcmp(grep_counts[slot].path, path) == 0) {
+            grep_counts[slot].count += count;
+            return;
+        }
+        slot = (slot + 1) & (grep_counts_cap - 1);
+    }
+
+    grep_counts[slot].path  = strdup(path);
+    grep_counts[slot].count = count;
+    grep_counts_len += 1;
+}
+
+static void _grep_counts_clear(void) {
+    int i;
+
+    for (i = 0; i < grep_counts_cap; i++) {
+        free(grep_counts[i].path);
+    }
+    free(grep_counts);
+
+    grep_counts     = NULL;
+    grep_counts_cap = 0;
+    grep_counts_len = 0;
+}
+
+/*
+ * Pull the longest run of characters that every match of the (extended)
+ * regex must contain.  memmem() on that run rejects most files without ever
+ * calling regexec().  *pure is set when the pattern has no regex syntax at
+ * all, in which case regexec() is skipped entirely.
+ */
+static void _grep_literal(const char *pat, char *out, int cap, int *pure) {
+    char run[256];
+    int  run_len;
+    int  best_len;
+    int  depth;
+
+    *pure    = 1;
+    run_len  = 0;
+    best_len = 0;
+    out[0]   = 0;
+
+#define END_RUN()                                \
+    do {                                         \
+        if (run_len >= cap) {                    \
+            /* can't hold the whole run */       \
+            *pure = 0;                           \
+        } else if (run_len > best_len) {         \
+            memcpy(out, run, run_len);           \
+            out[run_len] = 0;                    \
+            best_len     = run_len;              \
+        }                                        \
+        run_len = 0;                             \
+    } while (0)
+
+    if (strchr(pat, '|')) {
+        *pure = 0;
+        return;
+    }
+
+    while (*pat) {
+        switch (*pat) {
+            case '*':
+            case '?':
+            case '{':
+                /* the previous character is optional */
+                *pure = 0;
+                if (run_len > 0) { run_len -= 1; }
+                END_RUN();
+                if (*pat == '{') {
+                    while (*pat && *pat != '}') { pat++; }
+                    if (!*pat) { goto out; }
+                }
+                break;
+            case '+':
+                *pure = 0;
+                END_RUN();
+                break;
+            case '[':
+                *pure = 0;
+                END_RUN();
+                pat++;
+                if (*pat == '^') { pat++; }
+                if (*pat == ']') { pat++; }
+                while (*pat && *pat != ']') { pat++; }
+                if (!*pat) { goto out; }
+                break;
+            case '(':
+                /* groups may be optional; ignore everything inside */
+                *pure = 0;
+                END_RUN();
+                depth = 0;
+                while (*pat) {
+                    if      (*pat == '\\' && pat[1]) { pat++; }
+                    else if (*pat == '(')            { depth++; }
+                    else if (*pat == ')' && --depth == 0) { break; }
+                    pat++;
+                }
+                if (!*pat) { goto out; }
+                if (pat[1] == '*' || pat[1] == '?' || pat[1] == '+') { pat++; }
+                break;
+            case '.':
+            case '^':
+            case '$':
+            case ')':
+                *pure = 0;
+                END_RUN();
+                break;
+            case '\\':
+                *pure = 0;
+                if (pat[1] && strchr(".[]()^$*+?{}|\\/", pat[1])) {
+                    pat++;
+                    if (run_len < (int)sizeof(run)) { run[run_len++] = *pat; }
+                    else                            { *pure = 0;             }
+                } else {
+                    END_RUN();
+                    if (pat[1]) { pat++; }
+                }
+                break;
+            default:
+                if (run_len < (int)sizeof(run)) { run[run_len++] = *pat; }
+                else                            { *pure = 0;             }
+                break;
+        }
+        pat++;
+    }
+
+out:;
+    END_RUN();
+#undef END_RUN
+}
+
+static int _grep_line_matches(grep_job *job, const char *start, const char *end) {
+    regmatch_t m;
+#ifndef REG_STARTEND
+    char       line[4096];
+    int        len;
+#endif
+
+    if (job->pure) { return 1; }
+
+#ifdef REG_STARTEND
+    /* match straight out of the mapping */
+    m.rm_so = 0;
+    m.rm_eo = end - start;
+    return regexec(&job->re, start, 1, &m, REG_STARTEND) == 0;
+#else
+    len = end - start;
+    if (len >= (int)sizeof(line)) { len = sizeof(line) - 1; }
+    memcpy(line, start, len);
+    line[len] = 0;
+    return regexec(&job->re, line, 1, &m, 0) == 0;
+#endif
+}
+
+static int _grep_file(grep_job *job, const char *path) {
+    struct stat  statbuf;
+    const char  *data;
+    const char  *end;
+    const char  *pos;
+    const char  *hit;
+    const char  *line_start;
+    const char  *line_end;
+    size_t       sniff;
+    int          fd;
+    int          count;
+
+    if ((fd = open(path, O_RDONLY)) < 0) { return 0; }
+
+    if (fstat(fd, &statbuf) != 0 || statbuf.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) { return 0; }
+
+    madvise((void *)data, statbuf.st_size, MADV_SEQUENTIAL);
+
+    end   = data + statbuf.st_size;
+    count = 0;
+
+    /* binary files: a NUL in the first block */
+    sniff = statbuf.st_size < 8192 ? statbuf.st_size : 8192;
+    if (memchr(data, 0, sniff)) { goto out; }
+
+    pos = data;
+    while (pos < end && !__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) {
+        if (job->literal_len > 0) {
+            hit = memmem(pos, end - pos, job->literal, job->literal_len);
+            if (hit == NULL) { break; }
+        } else {
+            hit = pos;
+        }
+
+        line_start = hit;
+        while (line_start > pos && line_start[-1] != '\n') { line_start--; }
+        line_end = memchr(hit, '\n', end - hit);
+        if (line_end == NULL) { line_end = end; }
+
+        if (_grep_line_matches(job, line_start, line_end)) {
+            count += 1;
+        }
+
+        pos = line_end + 1;
+    }
+
+out:;
+    munmap((void *)data, statbuf.st_size);
+
+    return count;
+}
+
+static void _grep_push_dir(grep_job *job, int worker, char *path) {
+    grep_deque *dq;
+
+    __atomic_add_fetch(&job->outstanding, 1, __ATOMIC_SEQ_CST);
+
+    dq = &job->deques[worker];
+    pthread_mutex_lock(&dq->lock);
+    array_push(dq->dirs, path);
+    pthread_mutex_unlock(&dq->lock);
+
+    __atomic_add_fetch(&job->queued, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&job->idle_lock);
+    pthread_cond_signal(&job->idle);
+    pthread_mutex_unlock(&job->idle_lock);
+}
+
+/* Wake every parked worker so it can notice cancel or the end of the walk. */
+static void _grep_wake_all(grep_job *job) {
+    pthread_mutex_lock(&job->idle_lock);
+    pthread_cond_broadcast(&job->idle);
+    pthread_mutex_unlock(&job->idle_lock);
+}
+
+/* Own work comes off the back (depth first, warm caches), stolen work off
+ * the front (the shallowest, and so largest, pending subtrees). */
+static char *_grep_take_dir(grep_job *job, int worker) {
+    grep_deque *dq;
+    char       *path;
+    int         i;
+    int         victim;
+
+    path = NULL;
+
+    dq = &job->deques[worker];
+    pthread_mutex_lock(&dq->lock);
+    if (array_len(dq->dirs) > 0) {
+        path = *(char **)array_last(dq->dirs);
+        array_delete(dq->dirs, array_len(dq->dirs) - 1);
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    if (path) { goto taken; }
+
+    for (i = 1; i < job->n_workers; i++) {
+        victim = (worker + i) % job->n_workers;
+        dq     = &job->deques[victim];
+
+        pthread_mutex_lock(&dq->lock);
+        if (array_len(dq->dirs) > 0) {
+            path = *(char **)array_item(dq->dirs, 0);
+            array_delete(dq->dirs, 0);
+        }
+        pthread_mutex_unlock(&dq->lock);
+
+        if (path) { goto taken; }
+    }
+
+    return NULL;
+
+taken:;
+    __atomic_sub_fetch(&job->queued, 1, __ATOMIC_SEQ_CST);
+
+    return path;
+}
+
+static void _grep_dir(grep_job *job, int worker, const char *dir_path) {
+    struct dirent *de;
+    struct stat    statbuf;
+    DIR           *dr;
+    char           path[1024];
+    char          *sub;
+    int            type;
+    int            count;
+    grep_result    result;
+
+    if ((dr = opendir(dir_path)) == NULL) { return; }
+
+    while ((de = readdir(dr)) != NULL) {
+        if (__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) { break; }
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (_is_hidden(job->hidden, de->d_name)) { continue; }
+
+        snprintf(path, sizeof(path), "%s/%s", dir_path, de->d_name);
+
+        type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            if (lstat(path, &statbuf) != 0) { continue; }
+            if      (S_ISDIR(statbuf.st_mode)) { type = DT_DIR; }
+            else if (S_ISREG(statbuf.st_mode)) { type = DT_REG; }
+        }
+
+        if (type == DT_DIR) {
+            sub = strdup(path);
+            _grep_push_dir(job, worker, sub);
+        } else if (type == DT_REG) {
+            if ((count = _grep_file(job, path)) > 0) {
+                result.path  = strdup(path);
+                result.count = count;
+
+                pthread_mutex_lock(&job->results_lock);
+                array_push(job->results, result);
+                pthread_mutex_unlock(&job->results_lock);
+            }
+        }
+    }
+
+    closedir(dr);
+}
+
+static void *_grep_worker(void *arg) {
+    grep_worker_arg *warg;
+    grep_job        *job;
+    char            *path;
+
+    warg = arg;
+    job  = warg->job;
+
+    while (!__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) {
+        if ((path = _grep_take_dir(job, warg->worker)) == NULL) {
+            if (__atomic_load_n(&job->outstanding, __ATOMIC_SEQ_CST) == 0) {
+                break;
+            }
+
+            /* Park until another worker queues a directory, the last
+             * outstanding one finishes, or the search is cancelled. */
+            pthread_mutex_lock(&job->idle_lock);
+            while (__atomic_load_n(&job->queued,      __ATOMIC_SEQ_CST) <= 0
+            &&     __atomic_load_n(&job->outstanding, __ATOMIC_SEQ_CST) != 0
+            &&     !__atomic_load_n(&job->cancel,     __ATOMIC_SEQ_CST)) {
+                pthread_cond_wait(&job->idle, &job->idle_lock);
+            }
+            pthread_mutex_unlock(&job->idle_lock);
+            continue;
+        }
+
+        _grep_dir(job, warg->worker, path);
+        free(path);
+
+        if (__atomic_sub_fetch(&job->outstanding, 1, __ATOMIC_SEQ_CST) == 0) {
+            _grep_wake_all(job);
+        }
+    }
+
+    __atomic_add_fetch(&job->finished, 1, __ATOMIC_SEQ_CST);
+
+    return NULL;
+}
+
+/* Expand every ancestor of path and add count to it and its ancestors. */
+static void _grep_reveal(const char *path, int count) {
+    char  anc[512];
+    char *slash;
+    int   idx;
+    int   found;
+    file *f;
+
+    memset(anc, 0, sizeof(anc));
+    strncat(anc, path, sizeof(anc) - 1);
+
+    _grep_count_add(anc, count);
+    while ((slash = strrchr(anc, '/')) != NULL) {
+        *slash = 0;
+        _grep_count_add(anc, count);
+    }
+
+    memset(anc, 0, sizeof(anc));
+    strncat(anc, path, sizeof(anc) - 1);
+
+    found = 0;
+    slash = strchr(anc, '/');
+    while (slash != NULL) {
+        *slash = 0;
+
+        /* leading components above a root aren't in the tree; nor is
+         * the unnamed anchor row over several roots, whatever it matches */
+        if ((idx = _find_file(anc)) <= 0) {
+            if (found) { return; }
+            *slash = '/';
+            slash  = strchr(slash + 1, '/');
+            continue;
+        }
+        found = 1;
+
+        f = *(file **)array_item(files, idx);
+        if (f->flags == IS_DIR) {
+            if (f->open_children) {
+                _tree_view_redraw_row(idx);
+            } else if (idx > 0) {
+                _tree_view_add_dir(idx);
+                _tree_view_redraw_row(idx);
+            }
+        }
+
+        *slash = '/';
+        slash  = strchr(slash + 1, '/');
+    }
+
+    if ((idx = _find_file(anc)) > 0) {
+        _tree_view_redraw_row(idx);
+    }
+}
+
+static void _grep_stop(void) {
+    grep_result *r;
+    char       **c_it;
+    int          i;
+
+    if (grep == NULL) { return; }
+
+    __atomic_store_n(&grep->cancel, 1, __ATOMIC_SEQ_CST);
+    _grep_wake_all(grep);
+
+    for (i = 0; i < grep->n_threads; i++) {
+        pthread_join(grep->threads[i], NULL);
+    }
+
+    for (i = 0; i < grep->n_workers; i++) {
+        array_traverse(grep->deques[i].dirs, c_it) {
+            free(*c_it);
+        }
+        array_free(grep->deques[i].dirs);
+        pthread_mutex_destroy(&grep->deques[i].lock);
+    }
+
+    array_traverse(grep->results, r) {
+        free(r->path);
+    }
+    array_free(grep->results);
+    pthread_mutex_destroy(&grep->results_lock);
+    pthread_mutex_destroy(&grep->idle_lock);
+    pthread_cond_destroy(&grep->idle);
+
+    array_traverse(grep->hidden, c_it) {
+        free(*c_it);
+    }
+    array_free(grep->hidden);
+
+    if (!grep->pure) {
+        regfree(&grep->re);
+    }
+
+    free(grep->threads);
+    free(grep->deques);
+    free(grep->args);
+    free(grep);
+
+    grep = NULL;
+}
+
+/* Called from the pump: collect finished results.  Revealing them in the
+ * tree is left to TASK_GREP, which keeps to the handler budget. */
+static void _grep_drain(void) {
+    array_t      results;
+    grep_result *r;
+    int          done;
+
+    if (grep == NULL) { return; }
+
+    done = __atomic_load_n(&grep->finished, __ATOMIC_SEQ_CST) == grep->n_threads;
+
+    pthread_mutex_lock(&grep->results_lock);
+    results       = grep->results;
+    grep->results = array_make(grep_result);
+    pthread_mutex_unlock(&grep->results_lock);
+
+    array_traverse(results, r) {
+        array_push(grep_pending, *r);
+        grep_n_files += 1;
+    }
+    array_free(results);
+
+    if (array_len(grep_pending) > 0) {
+        _task_queue(TASK_GREP);
+    }
+
+    if (done) {
+        _grep_stop();
+        yed_cprint("tree-view-grep: %d matching files", grep_n_files);
+    }
+}
+
+/* Drops results that haven't been revealed yet, along with their task. */
+static void _grep_pending_clear(void) {
+    grep_result *r;
+
+    _task_cancel(TASK_GREP);
+
+    array_traverse(grep_pending, r) {
+        free(r->path);
+    }
+    array_clear(grep_pending);
+}
+
+static void _tree_view_grep(int n_args, char **args) {
+    char        pattern[512];
+    char      **str_it;
+    char       *str;
+    char       *root;
+    file       *f;
+    yed_frame  *frame;
+    int         i;
+    int         n;
+
+    _grep_stop();
+    _grep_pending_clear();
+    _grep_counts_clear();
+    grep_n_files = 0;
+
+    if (array_len(files) == 0) {
+        _tree_view_init();
+    }
+
+    for (i = 1; i < array_len(files); i++) {
+        _tree_view_redraw_row(i);
+    }
+
+    /* no pattern just clears the previous results */
+    if (n_args == 0) { return; }
+
+    memset(pattern, 0, sizeof(pattern));
+    for (i = 0; i < n_args; i++) {
+        if (i > 0) { strncat(pattern, " ", sizeof(pattern) - strlen(pattern) - 1); }
+        strncat(pattern, args[i], sizeof(pattern) - strlen(pattern) - 1);
+    }
+
+    grep = calloc(1, sizeof(grep_job));
+
+    _grep_literal(pattern, grep->literal, sizeof(grep->literal), &grep->pure);
+    grep->literal_len = strlen(grep->literal);
+
+    if (!grep->pure) {
+        if (regcomp(&grep->re, pattern, REG_EXTENDED | REG_NEWLINE | REG_NOSUB) != 0) {
+            yed_cerr("tree-view-grep: invalid pattern '%s'", pattern);
+            free(grep);
+            grep = NULL;
+            return;
+        }
+    }
+
+    grep->hidden = array_make(char *);
+    array_traverse(hidden_items, str_it) {
+        str = strdup(*str_it);
+        array_push(grep->hidden, str);
+    }
+
+    n = atoi(yed_get_var("tree-view-grep-threads"));
+    if (n <= 0) { n = sysconf(_SC_NPROCESSORS_ONLN); }
+    if (n <= 0) { n = 1; }
+
+    grep->n_workers = n;
+    grep->results   = array_make(grep_result);
+    grep->threads   = calloc(n, sizeof(pthread_t));
+    grep->deques    = calloc(n, sizeof(grep_deque));
+    grep->args      = calloc(n, sizeof(grep_worker_arg));
+    pthread_mutex_init(&grep->results_lock, NULL);
+    pthread_mutex_init(&grep->idle_lock, NULL);
+    pthread_cond_init(&grep->idle, NULL);
+
+    for (i = 0; i < n; i++) {
+        pthread_mutex_init(&grep->deques[i].lock, NULL);
+        grep->deques[i].dirs = array_make(char *);
+        grep->args[i].job    = grep;
+        grep->args[i].worker = i;
+    }
+
+    root  = NULL;
+    frame = ys->active_frame;
+    if (frame
+    &&  frame->buffer == _get_or_make_buff()
+    &&  frame->cursor_line < array_len(files)) {
+        f = *(file **)array_item(files, frame->cursor_line);
+        if (f->flags == IS_DIR) {
+            root = f->path;
+        } else if (f->parent && ((file *)f->parent)->path[0]) {
+            /* on a file, search the directory it is in */
+            root = ((file *)f->parent)->path;
+        }
+    }
+
+    if (root) {
+        str = strdup(root);
+        _grep_push_dir(grep, 0, str);
+    } else if (array_len(roots) == 0) {
+        str = strdup(".");
+        _grep_push_dir(grep, 0, str);
+    } else {
+        i = 0;
+        array_traverse(roots, str_it) {
+            str = strdup(*str_it);
+            _grep_push_dir(grep, i++ % n, str);
+        }
+    }
+
+    /* Workers steal from every deque, so the ones that did start cover
+     * the work queued for any that didn't. */
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&grep->threads[i], NULL, _grep_worker, &grep->args[i]) != 0) {
+            break;
+        }
+        grep->n_threads += 1;
+    }
+
+    if (grep->n_threads == 0) {
+        yed_cerr("tree-view-grep: could not start a search thread");
+        _grep_stop();
+    }
+}
+
+static void _tree_view_grep_cancel(int n_args, char **args) {
+    if (grep == NULL) { return; }
+
+    _grep_stop();
+    _grep_pending_clear();
+    yed_cprint("tree-view-grep: cancelled after %d matching files", grep_n_files);
+}
+
+static unsigned long long _now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
+
+static yed_buffer *_get_or_make_preview_buff(void) {
+    yed_buffer *buff;
+
+    buff = yed_get_buffer("*tree-view-preview");
+
+    if (buff == NULL) {
+        buff = yed_create_buffer("*tree-view-preview");
+        buff->flags |= BUFF_RD_ONLY | BUFF_SPECIAL;
+    }
+
+    return buff;
+}
+
+static void _preview_entry_free(preview_entry *entry) {
+    char **c_it;
+
+    array_traverse(entry->lines, c_it) {
+        free(*c_it);
+    }
+    array_free(entry->lines);
+    free(entry->path);
+    free(entry);
+}
+
+static void _preview_push_line(preview_entry *entry, const char *start, const char *end) {
+    char *line;
+    int   len;
+
+    len = end - start;
+    if (len > 0 && start[len - 1] == '\r') { len -= 1; }
+    if (len > PREVIEW_LINE_MAX)            { len  = PREVIEW_LINE_MAX; }
+
+    line = malloc(len + 1);
+    memcpy(line, start, len);
+    line[len] = 0;
+
+    array_push(entry->lines, line);
+}
+
+/*
+ * Only the first n_lines * PREVIEW_LINE_MAX bytes of the file are ever
+ * mapped, so previewing a multi-GB log costs the same as a small file.
+ */
+static preview_entry *_preview_load(const char *path, int n_lines) {
+    preview_entry *entry;
+    struct stat    statbuf;
+    const char    *data;
+    const char    *pos;
+    const char    *end;
+    const char    *nl;
+    size_t         window;
+    size_t         sniff;
+    char           msg[128];
+    int            fd;
+
+    /* FIFOs block open() and devices shouldn't be opened at all; stat()
+     * so that a link is judged by its target */
+    if (stat(path, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) { return NULL; }
+
+    /* O_NONBLOCK in case it was swapped for a FIFO since */
+    if ((fd = open(path, O_RDONLY | O_NONBLOCK | O_NOCTTY)) < 0) { return NULL; }
+
+    if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    entry        = calloc(1, sizeof(preview_entry));
+    entry->path  = strdup(path);
+    entry->mtime = statbuf.st_mtime;
+    entry->size  = statbuf.st_size;
+    entry->lines = array_make(char *);
+
+    window = (size_t)n_lines * PREVIEW_LINE_MAX;
+    if ((size_t)statbuf.st_size < window) { window = statbuf.st_size; }
+
+    if (window == 0) {
+        close(fd);
+        return entry;
+    }
+
+    data = mmap(NULL, window, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        _preview_entry_free(entry);
+        return NULL;
+    }
+
+    sniff = window < 1024 ? window : 1024;
+    if (memchr(data, 0, sniff)) {
+        snprintf(msg, sizeof(msg), "<binary file, %lld bytes>", (long long)statbuf.st_size);
+        _preview_push_line(entry, msg, msg + strlen(msg));
+        goto out;
+    }
+
+    pos = data;
+    end = data + window;
+    while (pos < end && array_len(entry->lines) < n_lines) {
+        nl = memchr(pos, '\n', end - pos);
+        if (nl == NULL) { nl = end; }
+
+        _preview_push_line(entry, pos, nl);
+
+        pos = nl + 1;
+    }
+
+out:;
+    munmap((void *)data, window);
+
+    return entry;
+}
+
+/* Small LRU keyed by path and validated against size and mtime. */
+static preview_entry *_preview_get(file *f, int n_lines) {
+    preview_entry **e_it;
+    preview_entry  *entry;
+    int             cap;
+    int             i;
+    int             oldest;
+
+    i = 0;
+    array_traverse(preview_cache, e_it) {
+        if (strcmp((*e_it)->path, f->path) == 0) {
+            if ((*e_it)->mtime == f->mtime
+            &&  (*e_it)->size  == f->size
+            &&  (*e_it)->n_lines == n_lines) {
+                (*e_it)->used = ++preview_clock;
+                return *e_it;
+            }
+            _preview_entry_free(*e_it);
+            array_delete(preview_cache, i);
+            break;
+        }
+        i++;
+    }
+
+    if ((entry = _preview_load(f->path, n_lines)) == NULL) { return NULL; }
+
+    entry->n_lines = n_lines;
+    entry->used    = ++preview_clock;
+
+    cap = atoi(yed_get_var("tree-view-preview-cache-size"));
+    if (cap < 1) { cap = 1; }
+
+    while (array_len(preview_cache) >= cap) {
+        oldest = 0;
+        for (i = 1; i < array_len(preview_cache); i++) {
+            if ((*(preview_entry **)array_item(preview_cache, i))->used
+            <   (*(preview_entry **)array_item(preview_cache, oldest))->used) {
+                oldest = i;
+            }
+        }
+        _preview_entry_free(*(preview_entry **)array_item(preview_cache, oldest));
+        array_delete(preview_cache, oldest);
+    }
+
+    array_push(preview_cache, entry);
+
+    return entry;
+}
+
+static void _preview_clear_cache(void) {
+    preview_entry **e_it;
+
+    array_traverse(preview_cache, e_it) {
+        _preview_entry_free(*e_it);
+    }
+    array_clear(preview_cache);
+}
+
+static void _preview_show(int idx) {
+    yed_buffer     *buff;
+    preview_entry  *entry;
+    file           *f;
+    char          **c_it;
+    int             row;
+    int             n_lines;
+
+    buff = _get_or_make_preview_buff();
+
+    buff->flags &= ~BUFF_RD_ONLY;
+    yed_buff_clear_no_undo(buff);
+
+    if (idx > 0 && idx < array_len(files)) {
+        f = *(file **)array_item(files, idx);
+
+        n_lines = atoi(yed_get_var("tree-view-preview-lines"));
+        if (n_lines < 1) { n_lines = 1; }
+
+        if (f->flags != IS_DIR && f->flags != IS_SUMMARY
+        &&  (entry = _preview_get(f, n_lines)) != NULL) {
+            row = 1;
+            array_traverse(entry->lines, c_it) {
+                if (row > 1) {
+                    yed_buff_insert_line_no_undo(buff, row);
+                }
+                yed_buff_insert_string_no_undo(buff, *c_it, row, 1);
+                row++;
+            }
+        }
+    }
+
+    buff->flags |= BUFF_RD_ONLY;
+}
+
+/* Called from the pump: follow the cursor once it has settled. */
+static void _preview_update(void) {
+    yed_frame          *frame;
+    unsigned long long  now;
+    int                 debounce;
+
+    if (!_is_yes(yed_get_var("tree-view-preview"))) { return; }
+
+    frame = ys->active_frame;
+    if (frame == NULL || frame->buffer != _get_or_make_buff()) { return; }
+
+    now = _now_ms();
+
+    if (frame->cursor_line != preview_pending_row) {
+        preview_pending_row   = frame->cursor_line;
+        preview_pending_since = now;
+        return;
+    }
+
+    if (preview_pending_row == preview_row
+    &&  preview_generation  == generation) {
         return;
     }
 
-    if (array_len(files) < event->row) { return; }
+    debounce = atoi(yed_get_var("tree-view-preview-debounce-ms"));
+    if (now - preview_pending_since < (unsigned long long)debounce) { return; }
 
-    f = *(file **) array_item(files, event->row);
-
-    if (f->path == NULL) { return; }
+    preview_row        = preview_pending_row;
+    preview_generation = generation;
+    _preview_show(preview_row);
+}
 
-    attr_dir         = ZERO_ATTR;
-    attr_exec        = ZERO_ATTR;
-    attr_symb_link   = ZERO_ATTR;
-    attr_device      = ZERO_ATTR;
-    attr_graphic_img = ZERO_ATTR;
-    attr_archive     = ZERO_ATTR;
-    attr_broken_link = ZERO_ATTR;
-    attr_file        = ZERO_ATTR;
+static void _tree_view_preview(int n_args, char **args) {
+    yed_frame *frame;
 
-    if ((color_var = yed_get_var("tree-view-directory-color"))) {
-        attr_dir         = yed_parse_attrs(color_var);
+    if (_is_yes(yed_get_var("tree-view-preview"))) {
+        yed_set_var("tree-view-preview", "no");
+        _preview_clear_cache();
+        preview_row = -1;
+        return;
     }
 
-    if ((color_var = yed_get_var("tree-view-exec-color"))) {
-        attr_exec         = yed_parse_attrs(color_var);
-    }
+    yed_set_var("tree-view-preview", "yes");
+    preview_row         = -1;
+    preview_pending_row = -1;
 
-    if ((color_var = yed_get_var("tree-view-symbolic-link-color"))) {
-        attr_symb_link         = yed_parse_attrs(color_var);
-    }
+    _get_or_make_preview_buff();
 
-    if ((color_var = yed_get_var("tree-view-device-color"))) {
-        attr_device         = yed_parse_attrs(color_var);
+    frame = ys->active_frame;
+    if (frame && frame->buffer == _get_or_make_buff()) {
+        YEXE("frame-vsplit");
+        YEXE("buffer", "*tree-view-preview");
+        yed_activate_frame(frame);
     }
+}
 
-    if ((color_var = yed_get_var("tree-view-graphic-image-color"))) {
-        attr_graphic_img         = yed_parse_attrs(color_var);
+static const char *export_kinds[] = {
+    "root", "file", "dir", "image", "archive", "link", "broken-link",
+    "device", "exec", "summary",
+};
+
+static void _export_strings_copy(array_t src, array_t *dst) {
+    char **str_it;
+    char  *str;
+
+    *dst = array_make(char *);
+    array_traverse(src, str_it) {
+        str = strdup(*str_it);
+        array_push(*dst, str);
     }
+}
 
-    if ((color_var = yed_get_var("tree-view-archive-color"))) {
-        attr_archive         = yed_parse_attrs(color_var);
+static void _export_strings_free(array_t *a) {
+    char **str_it;
+
+    array_traverse(*a, str_it) {
+        free(*str_it);
     }
+    array_free(*a);
+}
 
-    if ((color_var = yed_get_var("tree-view-broken-link-color"))) {
-        attr_broken_link         = yed_parse_attrs(color_var);
+static void _export_job_free(export_job *job) {
+    export_node *n_it;
+
+    array_traverse(job->nodes, n_it) {
+        free(n_it->path);
     }
+    array_free(job->nodes);
 
-    base = 0;
-    switch (f->flags) {
-        case IS_DIR:
-            attr_tmp = &attr_dir;
-            break;
-        case IS_LINK:
-            attr_tmp = &attr_symb_link;
-            break;
-        case IS_B_LINK:
-            attr_tmp = &attr_broken_link;
-            break;
-        case IS_DEVICE:
-            attr_tmp = &attr_device;
-            break;
-        case IS_ARCHIVE:
-            attr_tmp = &attr_archive;
-            break;
-        case IS_IMAGE:
-            attr_tmp = &attr_graphic_img;
-            break;
-        case IS_EXEC:
-            attr_tmp = &attr_exec;
+    _export_strings_free(&job->hidden);
+    _export_strings_free(&job->archive_extensions);
+    _export_strings_free(&job->image_extensions);
+
+    free(job->buff);
+    free(job);
+}
+
+static void _export_flush(export_job *job) {
+    struct pollfd  pfd;
+    ssize_t        n;
+    int            off;
+
+    off = 0;
+    while (off < job->buff_len && !job->error) {
+        if (__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) {
+            job->error = ECANCELED;
             break;
-        case IS_FILE:
-        default:
-            base = 1;
-            attr_tmp = &attr_file;
+        }
+
+        /* a stalled reader must not keep the thread from seeing cancel */
+        pfd.fd     = job->fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, 100) == 0) { continue; }
+
+        n = write(job->fd, job->buff + off, job->buff_len - off);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) { continue; }
+            job->error = errno;
             break;
+        }
+        off += n;
     }
 
-    if (event->frame->buffer == NULL) { return; }
+    job->buff_len = 0;
+}
 
-    line = yed_buff_get_line(event->frame->buffer, event->row);
-    if (line == NULL) { return; }
+static void _export_write(export_job *job, const char *data, int len) {
+    if (job->buff_len + len > EXPORT_BUFF_SIZE) {
+        _export_flush(job);
+    }
 
-    for (loc = 1; loc <= line->visual_width; loc += 1) {
-        if (loc > f->color_loc) {
-            if (!base) {
-                yed_eline_combine_col_attrs(event, loc, attr_tmp);
-            }
+    memcpy(job->buff + job->buff_len, data, len);
+    job->buff_len += len;
+}
+
+/* Appends s to out as the body of a JSON string.  out needs room for
+ * 6 bytes per input byte. */
+static int _export_json_escape(const char *s, char *out) {
+    unsigned char c;
+    int           len;
+
+    len = 0;
+    for (; (c = *s); s++) {
+        if (c == '"' || c == '\\') {
+            out[len++] = '\\';
+            out[len++] = c;
+        } else if (c < 0x20) {
+            len += sprintf(out + len, "\\u%04x", c);
+        } else {
+            out[len++] = c;
         }
     }
-}
 
-static void _tree_view_key_pressed_handler(yed_event *event) {
-  yed_frame *eframe;
+    return len;
+}
 
-    eframe = ys->active_frame;
+static void _export_put_le(unsigned char *out, unsigned long long val, int n) {
+    int i;
 
-    if (event->key != ENTER
-    ||  ys->interactive_command
-    ||  !eframe
-    ||  !eframe->buffer
-    ||  strcmp(eframe->buffer->name, "*tree-view-list")) {
-        return;
+    for (i = 0; i < n; i++) {
+        out[i] = (val >> (8 * i)) & 0xff;
     }
+}
 
-    _tree_view_select();
+static void _export_node(export_job *job, const char *path, int kind, int depth,
+                         unsigned mode, long long size, long long mtime) {
+    char          line[4096 * 6 + 256];
+    unsigned char rec[TREE_VIEW_SNAPSHOT_RECORD_SIZE];
+    int           len;
+    int           path_len;
 
-    event->cancel = 1;
-}
+    path_len = strlen(path);
 
-static void  _tree_view_update_handler(yed_event *event) {
-    file    **f;
-    char     *path;
-    array_t   open_dirs;
-    time_t    curr_time;
-    int       idx;
+    switch (job->format) {
+        case EXPORT_BINARY:
+            if (path_len > 0xffff) { return; }
 
-    curr_time = time(NULL);
+            rec[0] = (unsigned char)(signed char)kind;
+            _export_put_le(rec + 1,  depth,    2);
+            _export_put_le(rec + 3,  mode,     4);
+            _export_put_le(rec + 7,  size,     8);
+            _export_put_le(rec + 15, mtime,    8);
+            _export_put_le(rec + 23, path_len, 2);
 
-    if (curr_time > last_time + wait_time) {
+            _export_write(job, (char *)rec, sizeof(rec));
+            _export_write(job, path, path_len);
+            break;
 
-        open_dirs = array_make(char *);
+        default:
+            len = 0;
+            if (job->format == EXPORT_JSON) {
+                len += sprintf(line, job->count ? ",\n" : "\n");
+            }
 
-        idx = 0;
-        array_traverse(files, f) {
-            if (idx == 0) { idx++; continue; }
+            len += sprintf(line + len, "{\"path\":\"");
+            len += _export_json_escape(path, line + len);
+            len += sprintf(line + len,
+                           "\",\"kind\":\"%s\",\"depth\":%d,\"mode\":%u,\"size\":%lld,\"mtime\":%lld}",
+                           export_kinds[kind + 1], depth, mode, size, mtime);
 
-            if ((*f)->open_children) {
-                path = strdup((*f)->path);
-                array_push(open_dirs, path);
+            if (job->format == EXPORT_NDJSON) {
+                line[len++] = '\n';
             }
 
-            idx++;
+            _export_write(job, line, len);
+            break;
+    }
+
+    job->count += 1;
+}
+
+/* Depth first, in directory order, never following symbolic links.
+ * Memory use is bounded by the depth of the tree. */
+static void _export_walk(export_job *job, const char *dir_path, int depth) {
+    struct dirent *de;
+    struct stat    st;
+    struct stat    target;
+    DIR           *dr;
+    char           path[4096];
+    int            broken;
+    int            kind;
+
+    if ((dr = opendir(dir_path)) == NULL) { return; }
+
+    while ((de = readdir(dr)) != NULL
+    &&     !job->error
+    &&     !__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) { continue; }
+        if (_is_hidden(job->hidden, de->d_name)) { continue; }
+
+        snprintf(path, sizeof(path), "%s%s%s", dir_path,
+                 strcmp(dir_path, "/") == 0 ? "" : "/", de->d_name);
+
+        if (lstat(path, &st) != 0) { continue; }
+
+        broken = S_ISLNK(st.st_mode) && stat(path, &target) != 0 && errno == ENOENT;
+        kind   = _classify_with(de->d_name, st.st_mode, broken,
+                                job->archive_extensions, job->image_extensions);
+
+        _export_node(job, path, kind, depth, st.st_mode, st.st_size, st.st_mtime);
+
+        if (S_ISDIR(st.st_mode)
+        &&  (!job->one_filesystem || st.st_dev == job->walk_dev)) {
+            _export_walk(job, path, depth + 1);
         }
+    }
 
-        _tree_view_init();
+    closedir(dr);
+}
 
-        int found;
-        while (array_len(open_dirs) > 0) {
-            found = 0;
-            path = *(char **)array_item(open_dirs, 0);
+static void *_export_worker(void *arg) {
+    export_job  *job;
+    export_node *n_it;
+    sigset_t     set;
+    int          flags;
 
-            idx = 0;
-            array_traverse(files, f) {
-                if (idx == 0) { idx++; continue; }
+    job = arg;
 
-                if (strcmp((*f)->path, path) == 0) {
-                    _tree_view_add_dir(idx);
-                    array_delete(open_dirs, 0);
-                    found = 1;
-                    break;
-                }
+    /* a reader that goes away should fail the write, not kill the editor */
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-                idx++;
-            }
+    /* opening a FIFO blocks until there is a reader, so wait for one here
+     * where it can be cancelled */
+    while ((job->fd = open(job->out_path, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0644)) < 0) {
+        if (errno != ENXIO) {
+            job->error = errno;
+            break;
+        }
+        if (__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) {
+            job->error = ECANCELED;
+            break;
+        }
+        usleep(50000);
+    }
+
+    if (job->fd >= 0) {
+        flags = fcntl(job->fd, F_GETFL);
+        fcntl(job->fd, F_SETFL, flags & ~O_NONBLOCK);
 
-            if (!found) {
-                array_delete(open_dirs, 0);
+        if (job->format == EXPORT_BINARY) {
+            _export_write(job, TREE_VIEW_SNAPSHOT_MAGIC, TREE_VIEW_SNAPSHOT_MAGIC_LEN);
+        } else if (job->format == EXPORT_JSON) {
+            _export_write(job, "[", 1);
+        }
+
+        if (job->walk[0]) {
+            _export_walk(job, job->walk, job->walk_depth);
+        } else {
+            array_traverse(job->nodes, n_it) {
+                if (job->error || __atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) { break; }
+                _export_node(job, n_it->path, n_it->kind, n_it->depth,
+                             n_it->mode, n_it->size, n_it->mtime);
             }
         }
 
-        last_time = curr_time;
+        if (job->format == EXPORT_JSON) {
+            _export_write(job, "\n]\n", 3);
+        }
+
+        if (__atomic_load_n(&job->cancel, __ATOMIC_RELAXED) && !job->error) {
+            job->error = ECANCELED;
+        }
+
+        _export_flush(job);
+        close(job->fd);
     }
-}
 
-static yed_buffer *_get_or_make_buff(void) {
-    yed_buffer *buff;
+    __atomic_store_n(&job->done, 1, __ATOMIC_SEQ_CST);
 
-    buff = yed_get_buffer("*tree-view-list");
+    return NULL;
+}
 
-    if (buff == NULL) {
-        buff = yed_create_buffer("*tree-view-list");
-        buff->flags |= BUFF_RD_ONLY | BUFF_SPECIAL;
-    }
+static void _export_stop(void) {
+    if (exporting == NULL) { return; }
 
-    return buff;
+    __atomic_store_n(&exporting->cancel, 1, __ATOMIC_SEQ_CST);
+    pthread_join(exporting->thread, NULL);
+
+    _export_job_free(exporting);
+    exporting = NULL;
 }
 
-static file *_init_file(int parent_idx, char *path, char *name, int if_dir, int num_tabs, int color_loc) {
-    file *f;
+static void _export_drain(void) {
+    if (exporting == NULL || !__atomic_load_n(&exporting->done, __ATOMIC_SEQ_CST)) { return; }
 
-    f = malloc(sizeof(file));
-    memset(f, 0, sizeof(file));
+    pthread_join(exporting->thread, NULL);
 
-    if (parent_idx == IS_ROOT) {
-        f->parent = NULL;
+    if (exporting->error) {
+        yed_cerr("tree-view-export: %s: %s", exporting->out_path, strerror(exporting->error));
     } else {
-        f->parent = *(struct file **) array_item(files, parent_idx);
+        yed_cprint("tree-view-export: wrote %lld nodes to %s", exporting->count, exporting->out_path);
     }
 
-    memset(f->path, 0, sizeof(char[512]));
-    strcat(f->path, path);
-
-    memset(f->name, 0, sizeof(char[512]));
-    strcat(f->name, name);
+    _export_job_free(exporting);
+    exporting = NULL;
+}
 
-    f->flags         = if_dir;
-    f->num_tabs      = num_tabs;
-    f->open_children = 0;
-    f->color_loc     = color_loc;
+/* The depth a row for path would have: roots sit at 0, or the entries of
+ * "." do when it is the only one.  A directory under no root counts as a
+ * root of its own. */
+static int _export_walk_depth(const char *path) {
+    char       **c_it;
+    const char  *rest;
+    int          depth;
 
-    return f;
-}
+    depth = array_len(roots) == 0 ? -1 : 0;
+    rest  = "";
 
-static void _clear_files(void) {
-    file **file_it;
+    if (array_len(roots) == 0) {
+        if (_path_within(path, ".")) { rest = path + 1; }
+    } else {
+        array_traverse(roots, c_it) {
+            if (_path_within(path, *c_it)) {
+                rest = path + strlen(*c_it);
+                break;
+            }
+        }
+    }
 
-    array_traverse(files, file_it) {
-        free(*file_it);
+    if (*rest == '/') { rest += 1; }
+    if (*rest) {
+        depth += 1;
+        for (; *rest; rest++) {
+            if (*rest == '/') { depth += 1; }
+        }
     }
 
-    array_clear(files);
+    return depth + 1;
 }
 
-static int _cmpfunc(const void *a, const void *b) {
-    file *left_f;
-    file *right_f;
-    char  left_name[512];
-    char  right_name[512];
-    int   left;
-    int   right;
-    int   loc;
+/*
+ * tree-view-export <file> [json|ndjson|binary] [dir]
+ *
+ * Without dir, writes the nodes currently loaded in the tree, in row order.
+ * With dir, walks the whole subtree on disk instead.  Either way the
+ * writing happens on a worker thread, so file may be a FIFO whose reader
+ * has not shown up yet.
+ */
+static void _tree_view_export(int n_args, char **args) {
+    export_job  *job;
+    export_node  node;
+    file       **f_it;
+    struct stat  st;
+    char         walk[512];
+    int          format;
+
+    if (n_args < 1 || n_args > 3) {
+        yed_cerr("expected 1 to 3 arguments, but got %d", n_args);
+        return;
+    }
 
-    left_f  = *(file **)a;
-    right_f = *(file **)b;
+    if (exporting != NULL) {
+        yed_cerr("tree-view-export: already writing %s", exporting->out_path);
+        return;
+    }
 
-    left = 0;
-    if (left_f->flags == IS_DIR) {
-        left = 1;
+    format = EXPORT_JSON;
+    if (n_args >= 2) {
+        if (strcmp(args[1], "json") == 0) {
+            format = EXPORT_JSON;
+        } else if (strcmp(args[1], "ndjson") == 0) {
+            format = EXPORT_NDJSON;
+        } else if (strcmp(args[1], "binary") == 0) {
+            format = EXPORT_BINARY;
+        } else {
+            yed_cerr("tree-view-export: unknown format '%s'", args[1]);
+            return;
+        }
     }
 
-    right = 0;
-    if (right_f->flags == IS_DIR) {
-        right = 1;
+    if (n_args == 3) {
+        /* spelled the way the tree spells it */
+        _normalize_path(args[2], walk);
+
+        if (stat(walk, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            yed_cerr("tree-view-export: '%s' is not a directory", args[2]);
+            return;
+        }
     }
 
-    if (left < right) {
-        return  1;
-    } else if (left > right) {
-        return -1;
+    job         = calloc(1, sizeof(export_job));
+    job->format = format;
+    job->fd     = -1;
+    job->buff   = malloc(EXPORT_BUFF_SIZE);
+    job->nodes  = array_make(export_node);
+    strncat(job->out_path, args[0], sizeof(job->out_path) - 1);
+
+    _export_strings_copy(hidden_items, &job->hidden);
+    _export_strings_copy(archive_extensions, &job->archive_extensions);
+    _export_strings_copy(image_extensions, &job->image_extensions);
+
+    if (n_args == 3) {
+        strncat(job->walk, walk, sizeof(job->walk) - 1);
+        job->walk_depth     = _export_walk_depth(walk);
+        job->walk_dev       = st.st_dev;
+        job->one_filesystem = _is_yes(yed_get_var("tree-view-one-filesystem"));
     } else {
-        strcpy(left_name, left_f->name);
-        strcpy(right_name, right_f->name);
-
-        loc = 0;
-        while (left_name[loc]) {
-            left_name[loc] = tolower(left_name[loc]);
-            loc++;
+        /* the worker gets its own copy; the tree keeps changing */
+        array_traverse(files, f_it) {
+            if ((*f_it)->num_tabs < 0 || (*f_it)->flags == IS_SUMMARY) { continue; }
+
+            node.path  = strdup((*f_it)->path);
+            node.kind  = (*f_it)->flags;
+            node.depth = (*f_it)->num_tabs;
+            node.mode  = (*f_it)->mode;
+            node.size  = (*f_it)->size;
+            node.mtime = (*f_it)->mtime;
+            array_push(job->nodes, node);
         }
+    }
 
-        loc = 0;
-        while (right_name[loc]) {
-            right_name[loc] = tolower(right_name[loc]);
-            loc++;
+    if (pthread_create(&job->thread, NULL, _export_worker, job) != 0) {
+        yed_cerr("tree-view-export: could not start a thread");
+        _export_job_free(job);
+        return;
+    }
+
+    exporting = job;
+}
+
+static void _tree_view_export_cancel(int n_args, char **args) {
+    if (exporting == NULL) { return; }
+
+    _export_stop();
+    yed_cprint("tree-view-export: cancelled");
+}
+
+static void _add_roots(void) {
+    char  *copy;
+    char  *token;
+    char  *str;
+    char  *save;
+    char   path[512];
+    char **c_it;
+    int    dup;
+    int    i;
+
+    copy = strdup(yed_get_var("tree-view-roots") ? yed_get_var("tree-view-roots") : "");
+    for (token = strtok_r(copy, " ", &save); token; token = strtok_r(NULL, " ", &save)) {
+        _normalize_path(token, path);
+
+        dup = 0;
+        array_traverse(roots, c_it) {
+            if (strcmp(*c_it, path) == 0) { dup = 1; }
         }
+        if (dup) { continue; }
 
-    	return strcmp(left_name, right_name);
+        str = strdup(path);
+        array_push(roots, str);
     }
+    free(copy);
 
-    return ((file *)a)->flags - ((file *)b)->flags;
+    /* see _tree_view_add_root() */
+    for (i = 0; i < array_len(roots); i++) {
+        c_it = array_item(roots, i);
+        if (_root_is_nested(*c_it)) {
+            yed_cprint("tree-view: root '%s' is inside another root, ignoring it", *c_it);
+            free(*c_it);
+            array_delete(roots, i);
+            i -= 1;
+        }
+    }
+
+    if (array_len(roots) == 1 && strcmp(*(char **)array_item(roots, 0), ".") == 0) {
+        free(*(char **)array_item(roots, 0));
+        array_clear(roots);
+    }
 }
 
 static void _add_hidden_items(void) {
     char       *token;
     char       *tmp;
+    char       *copy;
     const char  s[2] = " ";
     char      **c_it;
 
     if (array_len(hidden_items) > 0) {
         array_traverse(hidden_items, c_it) {
-            free(c_it);
+            free(*c_it);
         }
-        array_clear(hidden_items);
     }
+    array_free(hidden_items);
     hidden_items = array_make(char *);
-    token = strtok(yed_get_var("tree-view-hidden-items"), s);
+    /* tokenize a copy; strtok() would cut the variable's own value short */
+    copy = strdup(yed_get_var("tree-view-hidden-items") ? yed_get_var("tree-view-hidden-items") : "");
+    token = strtok(copy, s);
     while(token != NULL) {
         tmp = strdup(token);
         array_push(hidden_items, tmp);
         token = strtok(NULL, s);
     }
+    free(copy);
 }
 
 static void _add_archive_extensions(void) {
     char       *token;
     char       *tmp;
     char       *str;
+    char       *copy;
     const char  s[2] = " ";
     char      **c_it;
 
     if (array_len(archive_extensions) > 0) {
         array_traverse(archive_extensions, c_it) {
-            free(c_it);
+            free(*c_it);
         }
-        array_clear(archive_extensions);
     }
+    array_free(archive_extensions);
     archive_extensions = array_make(char *);
 
     str = strdup(".a");       array_push(archive_extensions, str);
@@ -814,27 +5444,30 @@ static void _add_archive_extensions(void) {
     str = strdup(".msi");     array_push(archive_extensions, str);
     str = strdup(".crx");     array_push(archive_extensions, str);
 
-    token = strtok(yed_get_var("tree-view-archive-extensions"), s);
+    copy = strdup(yed_get_var("tree-view-archive-extensions") ? yed_get_var("tree-view-archive-extensions") : "");
+    token = strtok(copy, s);
     while(token != NULL) {
         tmp = strdup(token);
         array_push(archive_extensions, tmp);
         token = strtok(NULL, s);
     }
+    free(copy);
 }
 
 static void _add_image_extensions(void) {
     char       *token;
     char       *tmp;
     char       *str;
+    char       *copy;
     const char  s[2] = " ";
     char      **c_it;
 
     if (array_len(image_extensions) > 0) {
         array_traverse(image_extensions, c_it) {
-            free(c_it);
+            free(*c_it);
         }
-        array_clear(image_extensions);
     }
+    array_free(image_extensions);
     image_extensions = array_make(char *);
 
     str = strdup(".jpg");  array_push(image_extensions, str);
@@ -873,17 +5506,70 @@ static void _add_image_extensions(void) {
     str = strdup(".eps");  array_push(image_extensions, str);
     str = strdup(".pdf");  array_push(image_extensions, str);
 
-    token = strtok(yed_get_var("tree-view-image-extensions"), s);
+    copy = strdup(yed_get_var("tree-view-image-extensions") ? yed_get_var("tree-view-image-extensions") : "");
+    token = strtok(copy, s);
     while(token != NULL) {
         tmp = strdup(token);
         array_push(image_extensions, tmp);
         token = strtok(NULL, s);
     }
+    free(copy);
 }
 
 static void _tree_view_unload(yed_plugin *self) {
-    char **c_it;
-    file **file_it;
+    char       **c_it;
+    file       **file_it;
+    subscriber  *sub;
+    task       **t_it;
+
+    _grep_stop();
+    _grep_pending_clear();
+    array_free(grep_pending);
+    _grep_counts_clear();
+    _export_stop();
+
+    array_traverse(subscribers, sub) {
+        if (sub->fn) {
+            sub->fn(0, sub->arg);
+        }
+    }
+    array_free(subscribers);
+
+    free(path_index);
+    path_index     = NULL;
+    path_index_cap = 0;
+
+    array_free(mounts);
+    array_free(mount_points);
+    if (mountinfo_fd >= 0) {
+        close(mountinfo_fd);
+        mountinfo_fd = -1;
+    }
+
+    _preview_clear_cache();
+    array_free(preview_cache);
+
+    _listings_clear();
+    _metas_clear();
+
+    array_traverse(tasks, t_it) {
+        _task_free(*t_it);
+    }
+    array_free(tasks);
+
+#ifdef TREE_VIEW_URING
+    _uring_exit(&main_ring);
+#endif
+
+    array_traverse(roots, c_it) {
+        free(*c_it);
+    }
+    array_free(roots);
+
+    array_traverse(forced_dirs, c_it) {
+        free(*c_it);
+    }
+    array_free(forced_dirs);
 
     if (array_len(files) > 0) {
         array_traverse(files, file_it) {
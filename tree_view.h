@@ -0,0 +1,93 @@
+#ifndef TREE_VIEW_H
+#define TREE_VIEW_H
+
+/*
+ * Query interface for other plugins that want to reuse the nodes tree_view
+ * has already scanned instead of walking the filesystem again.
+ *
+ * Resolve the entry point with dlsym() on the tree_view plugin's handle:
+ *
+ *     const tree_view_api *(*get)(void);
+ *     get = dlsym(handle, "tree_view_get_api");
+ *
+ * All calls must be made from the editor thread (i.e. from a command or an
+ * event handler).  Node pointers handed to a visitor are only valid for the
+ * duration of that call.
+ */
+
+#define TREE_VIEW_API_VERSION 1
+
+/* node kinds */
+#define TREE_VIEW_ROOT    -1
+#define TREE_VIEW_FILE     0
+#define TREE_VIEW_DIR      1
+#define TREE_VIEW_IMAGE    2
+#define TREE_VIEW_ARCHIVE  3
+#define TREE_VIEW_LINK     4
+#define TREE_VIEW_B_LINK   5
+#define TREE_VIEW_DEVICE   6
+#define TREE_VIEW_EXEC     7
+/* placeholder row for a directory too large to load; its path is the
+ * directory's path with a trailing '/' */
+#define TREE_VIEW_SUMMARY  8
+
+typedef struct {
+    const char *path;
+    const char *name;
+    int         kind;
+    int         depth;
+    int         expanded;
+    unsigned    mode;
+    long long   size;
+    long long   mtime;
+} tree_view_node;
+
+/* Return non-zero to stop the walk. */
+typedef int  (*tree_view_visit_fn)(const tree_view_node *node, void *arg);
+
+/* Called at most once per editor pump after the store changed.
+ * A generation of 0 means tree_view is unloading and the api pointer
+ * must no longer be used. */
+typedef void (*tree_view_change_fn)(unsigned long long generation, void *arg);
+
+typedef struct {
+    int                  version;
+    /* bumped every time nodes are added, removed or changed in place */
+    unsigned long long (*generation)(void);
+    /* 0 on success, -1 if the path is not loaded */
+    int                (*lookup)(const char *path, tree_view_node *out);
+    /* number of children visited, -1 if the path or its children are not loaded */
+    int                (*children)(const char *path, tree_view_visit_fn fn, void *arg);
+    /* visit every loaded node at or below the path prefix; it matches
+     * whole components, so "./lib" does not match "./library" */
+    int                (*prefix)(const char *prefix, tree_view_visit_fn fn, void *arg);
+    /* visit every loaded node whose path matches an fnmatch(3) pattern */
+    int                (*glob)(const char *pattern, tree_view_visit_fn fn, void *arg);
+    /* returns a handle for unsubscribe(), -1 on failure */
+    int                (*subscribe)(tree_view_change_fn fn, void *arg);
+    void               (*unsubscribe)(int handle);
+} tree_view_api;
+
+const tree_view_api *tree_view_get_api(void);
+
+/*
+ * Layout of "tree-view-export <file> binary".  Integers are little-endian.
+ * The file starts with the TREE_VIEW_SNAPSHOT_MAGIC_LEN bytes of
+ * TREE_VIEW_SNAPSHOT_MAGIC (whose last byte is the format version),
+ * followed by one record per node until end of file:
+ *
+ *     offset  size  field
+ *          0     1  kind (signed, one of the TREE_VIEW_* kinds)
+ *          1     2  depth
+ *          3     4  mode
+ *          7     8  size
+ *         15     8  mtime, in seconds since the epoch
+ *         23     2  length of the path that follows
+ *         25     -  path, not NUL-terminated
+ */
+#define TREE_VIEW_SNAPSHOT_MAGIC       "TVSNAP\0\1"
+#define TREE_VIEW_SNAPSHOT_MAGIC_LEN   8
+#define TREE_VIEW_SNAPSHOT_VERSION     1
+#define TREE_VIEW_SNAPSHOT_RECORD_SIZE 25
+
+#endif